@@ -15,8 +15,31 @@
 
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
@@ -37,30 +60,185 @@ static inline void fillPlane(uint8_t *data, int width, int height, int stride, i
 }
 
 
+static void PlaneHistogram(uint32_t *hist, const uint8_t *ptr, int width, int height, int stride) {
+    memset(hist, 0, 256 * sizeof(uint32_t));
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            hist[ptr[x]]++;
+
+        ptr += stride;
+    }
+}
+
+
+// Returns the value of the pixels if they are all the same, or -1. Stops
+// at the first row that differs, so it costs next to nothing on ordinary
+// pictures.
+static int PlaneConstant(const uint8_t *ptr, int width, int height, int stride) {
+    if (width <= 0 || height <= 0)
+        return -1;
+
+    // The first row is compared with itself shifted by one pixel, and the
+    // other rows with the first one.
+    if (memcmp(ptr, ptr + 1, width - 1))
+        return -1;
+
+    const uint8_t *row = ptr;
+
+    for (int y = 1; y < height; y++) {
+        row += stride;
+
+        if (memcmp(ptr, row, width))
+            return -1;
+    }
+
+    return ptr[0];
+}
+
+
 class CurveData {
 private:
     unsigned int sum[256];
     unsigned int div[256];
     unsigned char curve[256];
 
-public:
-    void Create(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, bool raw, int smoothing_window) {
-        // Clear data
+    void Clear() {
         for (int i = 0; i < 256; i++) {
             sum[i] = 0;
             div[i] = 0;
         }
+    }
 
-        // Populate data
+    bool Empty() const {
+        for (int i = 0; i < 256; i++)
+            if (div[i] != 0)
+                return false;
+
+        return true;
+    }
+
+    // The straightforward version of AddRows, used when opt is False to
+    // check that the optimised version gives the same results.
+    void AddRowsReference(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, CurveData *inverse) {
         for (int h = 0; h < height; h++) {
             for (int w = 0; w < width; w++) {
                 sum[ptr1[w]] += ptr2[w];
                 div[ptr1[w]] += 1;
+
+                if (inverse) {
+                    inverse->sum[ptr2[w]] += ptr1[w];
+                    inverse->div[ptr2[w]] += 1;
+                }
+            }
+            ptr1 += stride;
+            ptr2 += stride;
+        }
+    }
+
+    // Pixels are counted in four sub-histograms, one for each position
+    // modulo 4, so that runs of the same value don't keep waiting on the
+    // same counter, and each value's sum and count share a cache line.
+    // The sums wrap around exactly like sum[] does, so adding up the
+    // sub-histograms at the end gives the same result as counting into
+    // sum[] and div[] directly.
+    void AddRows(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, CurveData *inverse) {
+        uint32_t bins[4][256][2];
+        uint32_t inverse_bins[4][256][2];
+
+        memset(bins, 0, sizeof(bins));
+        if (inverse)
+            memset(inverse_bins, 0, sizeof(inverse_bins));
+
+        for (int h = 0; h < height; h++) {
+            int w = 0;
+
+            if (inverse) {
+                for (; w + 8 <= width; w += 8) {
+                    for (int k = 0; k < 8; k++) {
+                        bins[k & 3][ptr1[w + k]][0] += ptr2[w + k];
+                        bins[k & 3][ptr1[w + k]][1] += 1;
+                        inverse_bins[k & 3][ptr2[w + k]][0] += ptr1[w + k];
+                        inverse_bins[k & 3][ptr2[w + k]][1] += 1;
+                    }
+                }
+
+                for (; w < width; w++) {
+                    bins[w & 3][ptr1[w]][0] += ptr2[w];
+                    bins[w & 3][ptr1[w]][1] += 1;
+                    inverse_bins[w & 3][ptr2[w]][0] += ptr1[w];
+                    inverse_bins[w & 3][ptr2[w]][1] += 1;
+                }
+            } else {
+                for (; w + 8 <= width; w += 8) {
+                    for (int k = 0; k < 8; k++) {
+                        bins[k & 3][ptr1[w + k]][0] += ptr2[w + k];
+                        bins[k & 3][ptr1[w + k]][1] += 1;
+                    }
+                }
+
+                for (; w < width; w++) {
+                    bins[w & 3][ptr1[w]][0] += ptr2[w];
+                    bins[w & 3][ptr1[w]][1] += 1;
+                }
             }
             ptr1 += stride;
             ptr2 += stride;
         }
 
+        for (int i = 0; i < 256; i++) {
+            for (int b = 0; b < 4; b++) {
+                sum[i] += bins[b][i][0];
+                div[i] += bins[b][i][1];
+            }
+        }
+
+        if (inverse) {
+            for (int i = 0; i < 256; i++) {
+                for (int b = 0; b < 4; b++) {
+                    inverse->sum[i] += inverse_bins[b][i][0];
+                    inverse->div[i] += inverse_bins[b][i][1];
+                }
+            }
+        }
+    }
+
+    // If both planes are a single colour, such as the chroma of greyscale
+    // material, counts all their pixels at once and returns true. The
+    // sums are the same as when the pixels are counted one by one.
+    bool AddConstant(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, CurveData *inverse) {
+        int value1 = PlaneConstant(ptr1, width, height, stride);
+        if (value1 < 0)
+            return false;
+
+        int value2 = PlaneConstant(ptr2, width, height, stride);
+        if (value2 < 0)
+            return false;
+
+        unsigned int count = (unsigned int)width * (unsigned int)height;
+
+        sum[value1] += value2 * count;
+        div[value1] += count;
+
+        if (inverse) {
+            inverse->sum[value2] += value1 * count;
+            inverse->div[value2] += count;
+        }
+
+        return true;
+    }
+
+public:
+    // The number of pixels of each value accumulated so far. Only valid
+    // before Finish.
+    void Counts(uint32_t *counts) const {
+        for (int i = 0; i < 256; i++)
+            counts[i] = div[i];
+    }
+
+    // Turns the accumulated sums into the curve. The sums are modified, so
+    // a curve can only be finished once.
+    void Finish(bool raw, int smoothing_window) {
         // Raw curve
         for (int i = 0; i < 256; i++) {
             if (div[i] != 0) {
@@ -182,251 +360,2616 @@ public:
         }
     }
 
-    void Process(const uint8_t *srcp, uint8_t *dstp, int width, int height, int stride) {
-        for (int h = 0; h < height; h++) {
-            for (int w = 0; w < width; w++)
-                dstp[w] = curve[srcp[w]];
-
-            srcp += stride;
-            dstp += stride;
-        }
-    }
-
-    void Show(uint8_t *ptr, int stride, uint8_t color) {
-        for (int i = 0; i < 256; i++)
-            ptr[((255 - curve[i]) * stride) + i] = color;
-    }
+    static void FinishLabeled(CurveData *curves, int num_labels, bool raw, int smoothing_window) {
+        CurveData total;
+        total.Clear();
 
-    void Debug(uint8_t *ptr, int stride) {
-        for (int i = 0; i < 256; i++) {
-            for (int j = 0; j <= curve[i]; j++) {
-                ptr[((255 - j) * stride) + i] = curve[i];
+        for (int l = 0; l < num_labels; l++) {
+            for (int i = 0; i < 256; i++) {
+                total.sum[i] += curves[l].sum[i];
+                total.div[i] += curves[l].div[i];
             }
         }
 
-        for (int i = 0; i < 256; i++) {
-            if (curve[i] > 0) {
-                ptr[((255 - curve[i]) * stride) + i] = 255;
-            }
+        total.Finish(raw, smoothing_window);
+
+        for (int l = 0; l < num_labels; l++) {
+            if (curves[l].Empty())
+                memcpy(curves[l].curve, total.curve, sizeof(total.curve));
+            else
+                curves[l].Finish(raw, smoothing_window);
         }
     }
-};
 
+    // If inverse is not null, it receives the sums for the curve that maps
+    // clip2 to clip1, gathered in the same pass over the pixels.
+    //
+    // If tolerance is greater than 0, the rows are read in 16 interleaved
+    // groups, and reading stops as soon as a group moves no point of the
+    // raw curve by more than tolerance sixteenths of a code value.
+    //
+    // If opt is false, the reference version of the pixel loop is used.
+    void Accumulate(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, CurveData *inverse = nullptr, int tolerance = 0, bool opt = true) {
+        // Clear data
+        Clear();
 
-struct MatchHistogramData {
-    VSNodeRef *clip1;
-    VSNodeRef *clip2;
-    VSNodeRef *clip3;
-    bool raw;
-    bool show;
-    bool debug;
-    int smoothing_window;
-    int process[3];
-    VSVideoInfo vi;
-};
+        if (inverse)
+            inverse->Clear();
 
+        if (opt && AddConstant(ptr1, ptr2, width, height, stride, inverse))
+            return;
 
-static void VS_CC MatchHistogramInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    (void)in;
-    (void)out;
-    (void)core;
+        if (tolerance <= 0) {
+            if (opt)
+                AddRows(ptr1, ptr2, width, height, stride, inverse);
+            else
+                AddRowsReference(ptr1, ptr2, width, height, stride, inverse);
+            return;
+        }
 
-    MatchHistogramData *d = (MatchHistogramData *) *instanceData;
+        // Bit reversed, so that the rows read so far are always spread
+        // evenly over the frame.
+        static const int order[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
 
-    vsapi->setVideoInfo(&d->vi, 1, node);
-}
+        // Raw curve after the previous group of rows, in sixteenths.
+        int estimate[256];
 
+        for (int g = 0; g < 16; g++) {
+            int first = order[g];
+            if (first >= height)
+                continue;
 
-static const VSFrameRef *VS_CC MatchHistogramGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    (void)frameData;
+            if (opt)
+                AddRows(ptr1 + first * stride, ptr2 + first * stride, width, (height - first + 15) / 16, stride * 16, inverse);
+            else
+                AddRowsReference(ptr1 + first * stride, ptr2 + first * stride, width, (height - first + 15) / 16, stride * 16, inverse);
 
-    const MatchHistogramData *d = (const MatchHistogramData *) *instanceData;
+            // Values that appear for the first time don't count as a change.
+            int change = 0;
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->clip1, frameCtx);
-        vsapi->requestFrameFilter(n, d->clip2, frameCtx);
-        vsapi->requestFrameFilter(n, d->clip3, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef *src1 = vsapi->getFrameFilter(n, d->clip1, frameCtx);
-        const VSFrameRef *src2 = vsapi->getFrameFilter(n, d->clip2, frameCtx);
+            for (int i = 0; i < 256; i++) {
+                int value = div[i] ? (int)(((uint64_t)sum[i] * 16 + div[i] / 2) / div[i]) : -1;
 
-        VSFrameRef *dst;
+                if (g > 0 && value >= 0 && estimate[i] >= 0)
+                    change = std::max(change, std::max(value - estimate[i], estimate[i] - value));
 
-        CurveData curve;
+                estimate[i] = value;
+            }
 
-        if (d->debug) {
-            dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src1, core);
+            if (g > 0 && change <= tolerance)
+                break;
+        }
+    }
 
-            for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
-                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
-                int dst_width = vsapi->getFrameWidth(dst, plane);
-                int dst_height = vsapi->getFrameHeight(dst, plane);
-                int dst_stride = vsapi->getStride(dst, plane);
+    // If counts isn't null, it receives the histogram of ptr1.
+    void Create(const uint8_t *ptr1, const uint8_t *ptr2, int width, int height, int stride, bool raw, int smoothing_window, bool opt, CurveData *inverse = nullptr, uint32_t *counts = nullptr) {
+        Accumulate(ptr1, ptr2, width, height, stride, inverse, 0, opt);
 
-                fillPlane(dstp, dst_width, dst_height, dst_stride, plane ? 128 : 0);
+        if (counts)
+            Counts(counts);
 
-                if (!d->process[plane])
-                    continue;
+        Finish(raw, smoothing_window);
 
-                const uint8_t *src1p = vsapi->getReadPtr(src1, plane);
-                const uint8_t *src2p = vsapi->getReadPtr(src2, plane);
-                int src_width = vsapi->getFrameWidth(src1, plane);
-                int src_height = vsapi->getFrameHeight(src1, plane);
-                int src_stride = vsapi->getStride(src1, plane);
+        if (inverse)
+            inverse->Finish(raw, smoothing_window);
+    }
 
-                curve.Create(src1p, src2p, src_width, src_height, src_stride, d->raw, d->smoothing_window);
-                curve.Debug(vsapi->getWritePtr(dst, 0),
-                            vsapi->getStride(dst, 0));
-            }
-        } else { // Not debug
-            const VSFrameRef *src3 = vsapi->getFrameFilter(n, d->clip3, frameCtx);
+    // One curve per label. The label of each pixel is read from the first
+    // plane of the label clip, which is subsampled by ssw and ssh relative
+    // to the plane being processed. Labels without any pixels in the frame
+    // use the curve calculated from the whole plane (see FinishLabeled).
+    static void AccumulateLabeled(CurveData *curves, const uint8_t *label_map, const uint8_t *ptr1, const uint8_t *ptr2, const uint8_t *labelp, int label_stride, int ssw, int ssh, int width, int height, int stride, int num_labels, CurveData *inverses = nullptr) {
+        for (int l = 0; l < num_labels; l++) {
+            curves[l].Clear();
 
-            const VSFrameRef *plane_src[3] = {
-                d->process[0] ? nullptr : src3,
-                d->process[1] ? nullptr : src3,
-                d->process[2] ? nullptr : src3
-            };
+            if (inverses)
+                inverses[l].Clear();
+        }
 
-            int planes[3] = { 0, 1, 2 };
+        for (int h = 0; h < height; h++) {
+            if (inverses) {
+                for (int w = 0; w < width; w++) {
+                    int l = label_map[labelp[w << ssw]];
+                    curves[l].sum[ptr1[w]] += ptr2[w];
+                    curves[l].div[ptr1[w]] += 1;
+                    inverses[l].sum[ptr2[w]] += ptr1[w];
+                    inverses[l].div[ptr2[w]] += 1;
+                }
+            } else {
+                for (int w = 0; w < width; w++) {
+                    CurveData &c = curves[label_map[labelp[w << ssw]]];
+                    c.sum[ptr1[w]] += ptr2[w];
+                    c.div[ptr1[w]] += 1;
+                }
+            }
+            ptr1 += stride;
+            ptr2 += stride;
+            labelp += label_stride << ssh;
+        }
+    }
 
-            dst = vsapi->newVideoFrame2(d->vi.format, d->vi.width, d->vi.height, plane_src, planes, src3, core);
+    // Histogram matching: each value of clip1 is mapped to the first value
+    // of clip2 whose share of the cumulative histogram is at least as
+    // large as its own. The result is stored as sums, so Finish fills in
+    // the values missing from clip1 and smooths the curve as usual.
+    // The totals must be below 2^31.
+    void AccumulateCDF(const uint32_t *hist1, const uint32_t *hist2) {
+        Clear();
 
-            uint8_t show_colors[3] = { 235, 160, 96 };
+        uint64_t total1 = 0;
+        uint64_t total2 = 0;
 
-            for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
-                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
-                int src3dst_stride = vsapi->getStride(dst, plane);
+        for (int i = 0; i < 256; i++) {
+            total1 += hist1[i];
+            total2 += hist2[i];
+        }
 
-                if (d->process[plane]) {
-                    const uint8_t *src1p = vsapi->getReadPtr(src1, plane);
-                    const uint8_t *src2p = vsapi->getReadPtr(src2, plane);
-                    const uint8_t *src3p = vsapi->getReadPtr(src3, plane);
-                    int src12_width = vsapi->getFrameWidth(src1, plane);
-                    int src12_height = vsapi->getFrameHeight(src1, plane);
-                    int src12_stride = vsapi->getStride(src1, plane);
-                    int src3dst_width = vsapi->getFrameWidth(src3, plane);
-                    int src3dst_height = vsapi->getFrameHeight(src3, plane);
+        uint64_t cumulative1 = 0;
+        uint64_t cumulative2 = hist2[0];
+        int j = 0;
 
-                    curve.Create(src1p, src2p, src12_width, src12_height, src12_stride, d->raw, d->smoothing_window);
-                    curve.Process(src3p, dstp, src3dst_width, src3dst_height, src3dst_stride);
-                }
+        for (int i = 0; i < 256; i++) {
+            if (hist1[i] == 0)
+                continue;
 
-                if (d->show) {
-                    fillPlane(dstp,
-                              256 >> (plane ? d->vi.format->subSamplingW : 0),
-                              256 >> (plane ? d->vi.format->subSamplingH : 0),
-                              src3dst_stride,
-                              plane ? 128 : 16);
+            cumulative1 += hist1[i];
 
-                    if (d->process[plane]) {
-                        curve.Show(vsapi->getWritePtr(dst, 0),
-                                   vsapi->getStride(dst, 0),
-                                   show_colors[plane]);
-                    }
-                }
+            while (j < 255 && cumulative2 * total1 < cumulative1 * total2) {
+                j++;
+                cumulative2 += hist2[j];
             }
 
-            vsapi->freeFrame(src3);
+            sum[i] = j;
+            div[i] = 1;
         }
+    }
 
-        vsapi->freeFrame(src1);
-        vsapi->freeFrame(src2);
+    void Export(int64_t *values) const {
+        for (int i = 0; i < 256; i++)
+            values[i] = curve[i];
+    }
 
-        return dst;
+    void Save(uint8_t *data) const {
+        memcpy(data, curve, sizeof(curve));
     }
 
-    return nullptr;
-}
+    void Load(const uint8_t *data) {
+        memcpy(curve, data, sizeof(curve));
+    }
 
+    // Whether the curve, weakened by weight, maps every value from first to
+    // last to itself. Blending with a mask then leaves them unchanged too,
+    // because the mask's weights are at most weight.
+    bool IsIdentity(int first, int last, int weight) const {
+        for (int i = first; i <= last; i++)
+            if (((curve[i] - i) * weight + 128) >> 8)
+                return false;
 
-static void VS_CC MatchHistogramFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    (void)core;
+        return true;
+    }
 
-    MatchHistogramData *d = (MatchHistogramData *)instanceData;
+    // Move the curve towards the identity. weight goes from 0 (identity)
+    // to 256 (unchanged curve).
+    void Weaken(int weight) {
+        if (weight == 256)
+            return;
 
-    vsapi->freeNode(d->clip1);
-    vsapi->freeNode(d->clip2);
-    vsapi->freeNode(d->clip3);
-    free(d);
-}
+        for (int i = 0; i < 256; i++)
+            curve[i] = i + (((curve[i] - i) * weight + 128) >> 8);
+    }
 
+    // With a mask, each output pixel is a blend of the source pixel and
+    // the curve's output, weighted by blend_weight[mask pixel]. The mask
+    // has the same stride as the source.
+    void Process(const uint8_t *srcp, uint8_t *dstp, const uint8_t *maskp, const int *blend_weight, int width, int height, int stride) {
+        for (int h = 0; h < height; h++) {
+            if (maskp) {
+                for (int w = 0; w < width; w++)
+                    dstp[w] = srcp[w] + (((curve[srcp[w]] - srcp[w]) * blend_weight[maskp[w]] + 128) >> 8);
 
-static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    (void)userData;
+                maskp += stride;
+            } else {
+                for (int w = 0; w < width; w++)
+                    dstp[w] = curve[srcp[w]];
+            }
 
-    MatchHistogramData d;
-    memset(&d, 0, sizeof(d));
+            srcp += stride;
+            dstp += stride;
+        }
+    }
 
-    int err;
+    // Applies this curve to ptr1 and, in the same loop, accumulates the
+    // curve from ptr1 to ptr2 into next, so ptr1 is read only once. If
+    // counts isn't null, it receives the histogram of ptr1.
+    void ProcessAndCreate(CurveData &next, const uint8_t *ptr1, const uint8_t *ptr2, uint8_t *dstp, const uint8_t *maskp, const int *blend_weight, int width, int height, int stride, bool raw, int smoothing_window, uint32_t *counts = nullptr) const {
+        next.Clear();
 
-    d.raw = !!vsapi->propGetInt(in, "raw", 0, &err);
-    if (err)
-        d.raw = false;
+        for (int h = 0; h < height; h++) {
+            if (maskp) {
+                for (int w = 0; w < width; w++) {
+                    int v = ptr1[w];
+                    dstp[w] = v + (((curve[v] - v) * blend_weight[maskp[w]] + 128) >> 8);
+                    next.sum[v] += ptr2[w];
+                    next.div[v] += 1;
+                }
 
-    d.show = !!vsapi->propGetInt(in, "show", 0, &err);
-    if (err)
-        d.show = false;
+                maskp += stride;
+            } else {
+                for (int w = 0; w < width; w++) {
+                    int v = ptr1[w];
+                    dstp[w] = curve[v];
+                    next.sum[v] += ptr2[w];
+                    next.div[v] += 1;
+                }
+            }
 
-    d.debug = !!vsapi->propGetInt(in, "debug", 0, &err);
-    if (err)
-        d.debug = false;
+            ptr1 += stride;
+            ptr2 += stride;
+            dstp += stride;
+        }
 
-    if (d.debug)
-        d.show = false;
+        if (counts)
+            next.Counts(counts);
 
-    d.smoothing_window = int64ToIntS(vsapi->propGetInt(in, "smoothing_window", 0, &err));
-    if (err)
-        d.smoothing_window = 8;
+        next.Finish(raw, smoothing_window);
+    }
 
+    static void ProcessLabeled(const CurveData *curves, const uint8_t *label_map, const uint8_t *srcp, uint8_t *dstp, const uint8_t *maskp, const int *blend_weight, const uint8_t *labelp, int label_stride, int ssw, int ssh, int width, int height, int stride) {
+        for (int h = 0; h < height; h++) {
+            if (maskp) {
+                for (int w = 0; w < width; w++) {
+                    int matched = curves[label_map[labelp[w << ssw]]].curve[srcp[w]];
+                    dstp[w] = srcp[w] + (((matched - srcp[w]) * blend_weight[maskp[w]] + 128) >> 8);
+                }
 
-    if (d.smoothing_window < 0) {
-        vsapi->setError(out, "MatchHistogram: smoothing_window must not be negative.");
-        return;
+                maskp += stride;
+            } else {
+                for (int w = 0; w < width; w++)
+                    dstp[w] = curves[label_map[labelp[w << ssw]]].curve[srcp[w]];
+            }
+
+            srcp += stride;
+            dstp += stride;
+            labelp += label_stride << ssh;
+        }
+    }
+
+    void Show(uint8_t *ptr, int stride, uint8_t color) {
+        for (int i = 0; i < 256; i++)
+            ptr[((255 - curve[i]) * stride) + i] = color;
     }
 
+    void Debug(uint8_t *ptr, int stride) {
+        for (int i = 0; i < 256; i++) {
+            for (int j = 0; j <= curve[i]; j++) {
+                ptr[((255 - j) * stride) + i] = curve[i];
+            }
+        }
 
-    d.clip1 = vsapi->propGetNode(in, "clip1", 0, nullptr);
-    d.vi = *vsapi->getVideoInfo(d.clip1);
+        for (int i = 0; i < 256; i++) {
+            if (curve[i] > 0) {
+                ptr[((255 - curve[i]) * stride) + i] = 255;
+            }
+        }
+    }
 
-    d.clip2 = vsapi->propGetNode(in, "clip2", 0, nullptr);
-    const VSVideoInfo *vi2 = vsapi->getVideoInfo(d.clip2);
+    // Draws the same picture as Debug, scaled to size x size pixels (at
+    // most 4096). The rows are filled one at a time, without branches, so
+    // that the compiler can vectorise them.
+    void DebugScaled(uint8_t *ptr, int stride, int size) const {
+        uint8_t value[4096];
+        int top[4096];
 
-    d.clip3 = vsapi->propGetNode(in, "clip3", 0, &err);
-    if (err)
-        d.clip3 = vsapi->cloneNodeRef(d.clip1);
-    const VSVideoInfo *vi3 = vsapi->getVideoInfo(d.clip3);
+        for (int x = 0; x < size; x++) {
+            value[x] = curve[x * 256 / size];
+            top[x] = size - 1 - value[x] * size / 256;
+        }
 
-    if (d.vi.format != vi2->format ||
-        d.vi.format != vi3->format) {
-        vsapi->setError(out, "MatchHistogram: the clips must have the same format.");
-        vsapi->freeNode(d.clip1);
-        vsapi->freeNode(d.clip2);
-        vsapi->freeNode(d.clip3);
-        return;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++)
+                ptr[x] = y > top[x] ? value[x] : (y == top[x] && value[x] ? 255 : 0);
+
+            ptr += stride;
+        }
     }
+};
 
-    if (d.vi.width != vi2->width || d.vi.height != vi2->height) {
-        vsapi->setError(out, "MatchHistogram: the first two clips must have the same dimensions.");
+
+// Joint RGB matching. Instead of one curve per plane, clip1's RGB cube is
+// divided into a coarse lattice of size^3 nodes, and each node stores the
+// average offset that moves clip1's colours near it to clip2's colours.
+// The lattice is then applied to clip3 with tetrahedral interpolation.
+class LutData {
+private:
+    int size;
+    int nearest[256];   // lattice node closest to each 8 bit value
+    int cell[256];      // lattice cell containing each 8 bit value
+    int frac[256];      // position inside the cell, 0..256
+    int position[65];   // value of each lattice node, multiplied by 16
+
+    std::vector<int64_t> sum;   // 3 per node: offsets (clip2 - clip1) per channel
+    std::vector<unsigned int> div;
+
+    // 4 per node: r, g, b, 0, multiplied by 16. The fourth element
+    // lets SSE2 load a whole node at once.
+    std::vector<int16_t> lut;
+
+    // Scratch space for Create.
+    std::vector<int> offset;    // 3 per node, multiplied by 16
+    std::vector<uint8_t> known;
+
+    // Unlike CurveData, which continues the slope of the curve past its
+    // ends, the ends of each line keep the offset of the last known node.
+    // An edge node often has only a handful of pixels behind it, and
+    // continuing its slope would amplify their noise.
+    void FillAxis(int step, int line_step1, int line_step2) {
+        for (int l1 = 0; l1 < size; l1++) {
+            for (int l2 = 0; l2 < size; l2++) {
+                int base = l1 * line_step1 + l2 * line_step2;
+
+                int prev = -1;
+                for (int i = 0; i < size; i++) {
+                    if (!known[base + i * step])
+                        continue;
+
+                    int cur = base + i * step;
+
+                    if (prev == -1) {
+                        // Extend bottom
+                        for (int j = 0; j < i; j++)
+                            for (int c = 0; c < 3; c++)
+                                offset[(base + j * step) * 3 + c] = offset[cur * 3 + c];
+                    } else {
+                        // Fill missing
+                        int p = base + prev * step;
+                        for (int j = prev + 1; j < i; j++)
+                            for (int c = 0; c < 3; c++)
+                                offset[(base + j * step) * 3 + c] = offset[p * 3 + c] + IntDiv((j - prev) * (offset[cur * 3 + c] - offset[p * 3 + c]), i - prev);
+                    }
+
+                    prev = i;
+                }
+
+                if (prev == -1)
+                    continue;
+
+                // Extend top
+                int p = base + prev * step;
+                for (int j = prev + 1; j < size; j++)
+                    for (int c = 0; c < 3; c++)
+                        offset[(base + j * step) * 3 + c] = offset[p * 3 + c];
+
+                for (int i = 0; i < size; i++)
+                    known[base + i * step] = 1;
+            }
+        }
+    }
+
+public:
+    LutData(int lut_size)
+        : size(lut_size)
+        , sum(lut_size * lut_size * lut_size * 3)
+        , div(lut_size * lut_size * lut_size)
+        , lut(lut_size * lut_size * lut_size * 4)
+        , offset(lut_size * lut_size * lut_size * 3)
+        , known(lut_size * lut_size * lut_size)
+    {
+        for (int i = 0; i < size; i++)
+            position[i] = IntDiv(i * 255 * 16, size - 1);
+
+        for (int v = 0; v < 256; v++) {
+            nearest[v] = IntDiv(v * (size - 1), 255);
+            cell[v] = std::min(v * (size - 1) / 255, size - 2);
+            frac[v] = IntDiv((v * (size - 1) - cell[v] * 255) * 256, 255);
+        }
+    }
+
+    // Can be called again to reuse the memory for another frame.
+    void Create(const uint8_t * const *ptr1, const uint8_t * const *ptr2, int width, int height, int stride) {
+        std::fill(sum.begin(), sum.end(), 0);
+        std::fill(div.begin(), div.end(), 0);
+        std::fill(known.begin(), known.end(), 0);
+
+        const uint8_t *r1 = ptr1[0], *g1 = ptr1[1], *b1 = ptr1[2];
+        const uint8_t *r2 = ptr2[0], *g2 = ptr2[1], *b2 = ptr2[2];
+
+        // Populate data
+        for (int h = 0; h < height; h++) {
+            for (int w = 0; w < width; w++) {
+                int node = (nearest[b1[w]] * size + nearest[g1[w]]) * size + nearest[r1[w]];
+
+                sum[node * 3 + 0] += r2[w] - r1[w];
+                sum[node * 3 + 1] += g2[w] - g1[w];
+                sum[node * 3 + 2] += b2[w] - b1[w];
+                div[node] += 1;
+            }
+            r1 += stride;
+            g1 += stride;
+            b1 += stride;
+            r2 += stride;
+            g2 += stride;
+            b2 += stride;
+        }
+
+        int nodes = size * size * size;
+
+        for (int i = 0; i < nodes; i++) {
+            if (div[i] != 0) {
+                for (int c = 0; c < 3; c++) {
+                    int64_t s = sum[i * 3 + c] * 16;
+                    int64_t half = div[i] / 2;
+                    offset[i * 3 + c] = (int)(s < 0 ? (s - half) / (int64_t)div[i] : (s + half) / (int64_t)div[i]);
+                }
+                known[i] = 1;
+            }
+        }
+
+        // Empty nodes are interpolated along each axis in turn, the same
+        // way CurveData fills missing values. After the third axis every
+        // node is known, because every frame has at least one pixel.
+        FillAxis(1, size * size, size);
+        FillAxis(size, size * size, 1);
+        FillAxis(size * size, size, 1);
+
+        for (int b = 0; b < size; b++) {
+            for (int g = 0; g < size; g++) {
+                for (int r = 0; r < size; r++) {
+                    int node = (b * size + g) * size + r;
+                    int pos[3] = { position[r], position[g], position[b] };
+
+                    for (int c = 0; c < 3; c++)
+                        lut[node * 4 + c] = std::min(std::max(pos[c] + offset[node * 3 + c], 0), 255 * 16);
+                    lut[node * 4 + 3] = 0;
+                }
+            }
+        }
+    }
+
+    size_t SavedSize() const {
+        return lut.size() * sizeof(int16_t);
+    }
+
+    void Save(uint8_t *data) const {
+        memcpy(data, lut.data(), SavedSize());
+    }
+
+    void Load(const uint8_t *data) {
+        memcpy(lut.data(), data, SavedSize());
+    }
+
+    // Same as CurveData::Weaken. Interpolation is linear, so weakening the
+    // lattice nodes weakens every interpolated colour the same way.
+    void Weaken(int weight) {
+        if (weight == 256)
+            return;
+
+        for (int b = 0; b < size; b++) {
+            for (int g = 0; g < size; g++) {
+                for (int r = 0; r < size; r++) {
+                    int node = (b * size + g) * size + r;
+                    int pos[3] = { position[r], position[g], position[b] };
+
+                    for (int c = 0; c < 3; c++)
+                        lut[node * 4 + c] = pos[c] + (((lut[node * 4 + c] - pos[c]) * weight + 128) >> 8);
+                }
+            }
+        }
+    }
+
+    // If opt is false, the interpolation is done without SSE2.
+    void Process(const uint8_t * const *srcp, uint8_t * const *dstp, const uint8_t * const *maskp, const int *blend_weight, int width, int height, int stride, bool opt) {
+        const int16_t *table = lut.data();
+
+        const int step_r = 4;
+        const int step_g = size * 4;
+        const int step_b = size * size * 4;
+
+        for (int h = 0; h < height; h++) {
+            const uint8_t *rp = srcp[0] + h * stride;
+            const uint8_t *gp = srcp[1] + h * stride;
+            const uint8_t *bp = srcp[2] + h * stride;
+            uint8_t *rd = dstp[0] + h * stride;
+            uint8_t *gd = dstp[1] + h * stride;
+            uint8_t *bd = dstp[2] + h * stride;
+
+            for (int w = 0; w < width; w++) {
+                int fr = frac[rp[w]];
+                int fg = frac[gp[w]];
+                int fb = frac[bp[w]];
+
+                int base = (cell[bp[w]] * size + cell[gp[w]]) * size * 4 + cell[rp[w]] * 4;
+
+                // Tetrahedral interpolation: pick the tetrahedron inside
+                // the cell from the order of the fractional parts.
+                int o1, o2, w0, w1, w2, w3;
+                if (fr >= fg) {
+                    if (fg >= fb) {
+                        o1 = step_r; o2 = step_r + step_g;
+                        w0 = 256 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+                    } else if (fr >= fb) {
+                        o1 = step_r; o2 = step_r + step_b;
+                        w0 = 256 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+                    } else {
+                        o1 = step_b; o2 = step_r + step_b;
+                        w0 = 256 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+                    }
+                } else {
+                    if (fr >= fb) {
+                        o1 = step_g; o2 = step_r + step_g;
+                        w0 = 256 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+                    } else if (fg >= fb) {
+                        o1 = step_g; o2 = step_g + step_b;
+                        w0 = 256 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+                    } else {
+                        o1 = step_b; o2 = step_g + step_b;
+                        w0 = 256 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+                    }
+                }
+
+                const int16_t *v0 = table + base;
+                const int16_t *v1 = v0 + o1;
+                const int16_t *v2 = v0 + o2;
+                const int16_t *v3 = v0 + step_r + step_g + step_b;
+
+#if defined(__SSE2__)
+                if (opt) {
+                    // All three channels of two vertices per multiply-add.
+                    __m128i v01 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)v0), _mm_loadl_epi64((const __m128i *)v1));
+                    __m128i v23 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)v2), _mm_loadl_epi64((const __m128i *)v3));
+                    __m128i w01 = _mm_set1_epi32((w1 << 16) | w0);
+                    __m128i w23 = _mm_set1_epi32((w3 << 16) | w2);
+
+                    __m128i acc = _mm_add_epi32(_mm_madd_epi16(v01, w01), _mm_madd_epi16(v23, w23));
+                    acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(2048)), 12);
+                    acc = _mm_packs_epi32(acc, acc);
+                    acc = _mm_packus_epi16(acc, acc);
+
+                    uint32_t rgb = (uint32_t)_mm_cvtsi128_si32(acc);
+                    rd[w] = rgb & 0xff;
+                    gd[w] = (rgb >> 8) & 0xff;
+                    bd[w] = (rgb >> 16) & 0xff;
+
+                    continue;
+                }
+#else
+                (void)opt;
+#endif
+
+                uint8_t *out[3] = { rd + w, gd + w, bd + w };
+                for (int c = 0; c < 3; c++)
+                    *out[c] = (w0 * v0[c] + w1 * v1[c] + w2 * v2[c] + w3 * v3[c] + 2048) >> 12;
+            }
+
+            if (maskp) {
+                const uint8_t *src[3] = { rp, gp, bp };
+                uint8_t *dst[3] = { rd, gd, bd };
+
+                for (int c = 0; c < 3; c++) {
+                    const uint8_t *mp = maskp[c] + h * stride;
+
+                    for (int w = 0; w < width; w++)
+                        dst[c][w] = src[c][w] + (((dst[c][w] - src[c][w]) * blend_weight[mp[w]] + 128) >> 8);
+                }
+            }
+        }
+    }
+};
+
+
+// A LutData holds about 10 MB at a lut_size of 65, so rather than making
+// one for every frame, the frames borrow them from here. There are never
+// more than the number of frames made at the same time.
+class LutPool {
+private:
+    int size;
+    std::vector<LutData *> luts;
+    std::mutex lock;
+
+public:
+    LutPool(int lut_size)
+        : size(lut_size)
+    {
+    }
+
+    ~LutPool() {
+        for (size_t i = 0; i < luts.size(); i++)
+            delete luts[i];
+    }
+
+    LutData *Get() {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (luts.empty())
+            return new LutData(size);
+
+        LutData *lut = luts.back();
+        luts.pop_back();
+
+        return lut;
+    }
+
+    void Put(LutData *lut) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        luts.push_back(lut);
+    }
+};
+
+
+// Packs curves for a binary frame property. The first byte is 0 when the
+// curves follow unchanged, or 1 when they are delta coded: each value is
+// stored as the difference from the previous one (from 0 for the first),
+// and runs of equal differences as (run length, difference) byte pairs.
+// Smooth curves have long runs, so the delta coding is nearly always
+// smaller; if it isn't, the curves are stored unchanged.
+static void PackCurves(const uint8_t *curves, size_t size, std::vector<uint8_t> &packed) {
+    packed.assign(1, 1);
+
+    uint8_t prev = 0;
+
+    for (size_t i = 0; i < size; ) {
+        uint8_t delta = curves[i] - prev;
+
+        size_t run = 1;
+        while (i + run < size && run < 255 && (uint8_t)(curves[i + run] - curves[i + run - 1]) == delta)
+            run++;
+
+        packed.push_back((uint8_t)run);
+        packed.push_back(delta);
+
+        prev = curves[i + run - 1];
+        i += run;
+    }
+
+    if (packed.size() > size + 1) {
+        packed.assign(1, 0);
+        packed.insert(packed.end(), curves, curves + size);
+    }
+}
+
+
+// Attaches the curves of one plane to a frame, either as an array of
+// integers, 256 per curve, or packed into binary data by PackCurves.
+static void SetCurveProp(VSMap *props, const char *name, int plane, const CurveData *curves, int count, bool compact, const VSAPI *vsapi) {
+    char key[64];
+    snprintf(key, sizeof(key), "%s%d", name, plane);
+
+    if (compact) {
+        std::vector<uint8_t> values(count * 256);
+
+        for (int i = 0; i < count; i++)
+            curves[i].Save(values.data() + i * 256);
+
+        std::vector<uint8_t> packed;
+        PackCurves(values.data(), values.size(), packed);
+
+        vsapi->propSetData(props, key, (const char *)packed.data(), (int)packed.size(), paReplace);
+    } else {
+        std::vector<int64_t> values(count * 256);
+
+        for (int i = 0; i < count; i++)
+            curves[i].Export(values.data() + i * 256);
+
+        vsapi->propSetIntArray(props, key, values.data(), count * 256);
+    }
+}
+
+
+// Reads a precomputed histogram of one plane from the frame property
+// "MatchHistogramHistogram<plane>", an array of 256 counts. Returns 0 if
+// the frame doesn't have the property, -1 if it isn't a valid histogram.
+static int GetHistogramProp(uint32_t *hist, const VSFrameRef *frame, int plane, const VSAPI *vsapi) {
+    char key[64];
+    snprintf(key, sizeof(key), "MatchHistogramHistogram%d", plane);
+
+    const VSMap *props = vsapi->getFramePropsRO(frame);
+
+    int count = vsapi->propNumElements(props, key);
+    if (count < 0)
+        return 0;
+    if (count != 256 || vsapi->propGetType(props, key) != ptInt)
+        return -1;
+
+    const int64_t *values = vsapi->propGetIntArray(props, key, nullptr);
+
+    int64_t total = 0;
+
+    for (int i = 0; i < 256; i++) {
+        if (values[i] < 0 || values[i] > INT32_MAX)
+            return -1;
+
+        hist[i] = (uint32_t)values[i];
+        total += values[i];
+    }
+
+    if (total == 0 || total > INT32_MAX)
+        return -1;
+
+    return 1;
+}
+
+
+static int SeekFile(FILE *file, int64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+
+static int64_t FileSize(FILE *file) {
+#ifdef _WIN32
+    if (_fseeki64(file, 0, SEEK_END))
+        return -1;
+    return _ftelli64(file);
+#else
+    if (fseeko(file, 0, SEEK_END))
+        return -1;
+    return ftello(file);
+#endif
+}
+
+
+static int TruncateFile(FILE *file, int64_t size) {
+    if (fflush(file))
+        return -1;
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size);
+#else
+    return ftruncate(fileno(file), (off_t)size);
+#endif
+}
+
+
+// Curves are saved in shard files. Each shard is written by a single
+// process, so chunks of a clip rendered in parallel never wait for each
+// other. A shard starts with a ShardHeader and contains any number of
+// records in any order: the frame number (int32_t) followed by
+// record_size bytes of curves. Everything is in native byte order.
+struct ShardHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t fingerprint; // Identifies the parameters the curves were made with
+};
+
+static const char shard_magic[4] = { 'M', 'H', 'C', 'S' };
+
+
+class CurveShard {
+private:
+    FILE *file;
+    uint32_t record_size;
+    std::mutex lock;
+
+public:
+    CurveShard()
+        : file(nullptr)
+        , record_size(0)
+    {
+    }
+
+    ~CurveShard() {
+        if (file)
+            fclose(file);
+    }
+
+    // Creates the shard, or appends to it if it already exists.
+    bool Open(const char *path, uint32_t size, uint32_t fingerprint, std::string &error) {
+        record_size = size;
+
+        file = fopen(path, "a+b");
+        if (!file) {
+            error = std::string("failed to open curve shard '") + path + "'.";
+            return false;
+        }
+
+        int64_t file_size = FileSize(file);
+
+        if (file_size == 0) {
+            ShardHeader header;
+            memcpy(header.magic, shard_magic, sizeof(shard_magic));
+            header.version = 1;
+            header.record_size = record_size;
+            header.fingerprint = fingerprint;
+
+            if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file)) {
+                error = std::string("failed to write curve shard '") + path + "'.";
+                return false;
+            }
+        } else {
+            ShardHeader header;
+
+            if (SeekFile(file, 0) ||
+                fread(&header, sizeof(header), 1, file) != 1 ||
+                memcmp(header.magic, shard_magic, sizeof(shard_magic)) ||
+                header.version != 1) {
+                error = std::string("'") + path + "' is not a curve shard.";
+                return false;
+            }
+
+            if (header.record_size != record_size || header.fingerprint != fingerprint) {
+                error = std::string("curve shard '") + path + "' was made with different parameters.";
+                return false;
+            }
+
+            // A record cut short by a crash is removed, so that the new
+            // records don't start in the middle of one.
+            int64_t stride = sizeof(int32_t) + record_size;
+            int64_t partial = (file_size - (int64_t)sizeof(header)) % stride;
+
+            if (partial && TruncateFile(file, file_size - partial)) {
+                error = std::string("failed to write curve shard '") + path + "'.";
+                return false;
+            }
+
+            // The header was read last, and a stream must be positioned
+            // before it can be written to after a read.
+            if (FileSize(file) < 0) {
+                error = std::string("failed to write curve shard '") + path + "'.";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool Write(int n, const uint8_t *data) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Writes always go to the end of the file in append mode. A record
+        // cut short by a crash is ignored when the shard is read, and
+        // removed when the shard is opened for writing again.
+        int32_t frame = n;
+
+        return fwrite(&frame, sizeof(frame), 1, file) == 1 &&
+               fwrite(data, record_size, 1, file) == 1 &&
+               !fflush(file);
+    }
+};
+
+
+// Curves read from one shard, or from all the shards listed in a
+// manifest. A manifest is a text file with the path of one shard per
+// line, relative to the manifest. Empty lines and lines starting with
+// '#' are ignored. The location of every frame's curves is indexed once,
+// when the store is opened.
+class CurveStore {
+private:
+    struct Location {
+        int shard;
+        int64_t offset;
+    };
+
+    std::vector<FILE *> files;
+    std::vector<Location> index;
+    uint32_t record_size;
+    uint32_t fingerprint;
+    int max_frames;
+#ifdef _WIN32
+    std::mutex lock;
+#endif
+
+    bool AddShard(const std::string &path, std::string &error) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file) {
+            error = "failed to open curve shard '" + path + "'.";
+            return false;
+        }
+
+        files.push_back(file);
+
+        ShardHeader header;
+
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, shard_magic, sizeof(shard_magic)) ||
+            header.version != 1) {
+            error = "'" + path + "' is not a curve shard.";
+            return false;
+        }
+
+        if (files.size() == 1) {
+            record_size = header.record_size;
+            fingerprint = header.fingerprint;
+        } else if (header.record_size != record_size || header.fingerprint != fingerprint) {
+            error = "curve shard '" + path + "' was made with different parameters than the other shards.";
+            return false;
+        }
+
+        int64_t file_size = FileSize(file);
+        int64_t stride = sizeof(int32_t) + record_size;
+        int64_t records = (file_size - (int64_t)sizeof(header)) / stride;
+
+        for (int64_t r = 0; r < records; r++) {
+            int64_t offset = sizeof(header) + r * stride;
+            int32_t frame;
+
+            if (SeekFile(file, offset) || fread(&frame, sizeof(frame), 1, file) != 1) {
+                error = "failed to read curve shard '" + path + "'.";
+                return false;
+            }
+
+            // Frame numbers are checked before they size the index, in
+            // case the shard is damaged.
+            if (frame < 0 || frame >= max_frames)
+                continue;
+
+            if ((size_t)frame >= index.size())
+                index.resize(frame + 1, Location{ -1, 0 });
+
+            index[frame].shard = (int)files.size() - 1;
+            index[frame].offset = offset + sizeof(int32_t);
+        }
+
+        return true;
+    }
+
+public:
+    CurveStore()
+        : record_size(0)
+        , fingerprint(0)
+        , max_frames(0)
+    {
+    }
+
+    ~CurveStore() {
+        for (size_t i = 0; i < files.size(); i++)
+            fclose(files[i]);
+    }
+
+    // Curves of frames from num_frames on are ignored.
+    bool Open(const char *path, int num_frames, std::string &error) {
+        max_frames = num_frames;
+
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+            error = std::string("failed to open curve store '") + path + "'.";
+            return false;
+        }
+
+        char magic[4] = { 0 };
+        bool is_shard = fread(magic, sizeof(magic), 1, file) == 1 && !memcmp(magic, shard_magic, sizeof(shard_magic));
+
+        if (is_shard) {
+            fclose(file);
+            return AddShard(path, error);
+        }
+
+        std::string manifest;
+        char buffer[4096];
+        size_t bytes;
+
+        SeekFile(file, 0);
+        while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            manifest.append(buffer, bytes);
+        fclose(file);
+
+        std::string dir(path);
+        size_t slash = dir.find_last_of("/\\");
+        dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+        size_t start = 0;
+        while (start < manifest.size()) {
+            size_t end = manifest.find('\n', start);
+            if (end == std::string::npos)
+                end = manifest.size();
+
+            std::string line = manifest.substr(start, end - start);
+            start = end + 1;
+
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+                line.pop_back();
+
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            bool absolute = line[0] == '/' || line[0] == '\\' || (line.size() > 1 && line[1] == ':');
+
+            if (!AddShard(absolute ? line : dir + line, error))
+                return false;
+        }
+
+        if (files.empty()) {
+            error = std::string("curve store '") + path + "' lists no shards.";
+            return false;
+        }
+
+        return true;
+    }
+
+    uint32_t RecordSize() const {
+        return record_size;
+    }
+
+    uint32_t Fingerprint() const {
+        return fingerprint;
+    }
+
+    int NumFrames() const {
+        return (int)index.size();
+    }
+
+    bool Has(int n) const {
+        return n < (int)index.size() && index[n].shard != -1;
+    }
+
+    // Safe to call from several threads at once. Reads don't wait for
+    // each other, except on Windows, where they take turns.
+    bool Read(int n, uint8_t *data) {
+        FILE *file = files[index[n].shard];
+
+#ifdef _WIN32
+        std::lock_guard<std::mutex> guard(lock);
+
+        return !SeekFile(file, index[n].offset) && fread(data, record_size, 1, file) == 1;
+#else
+        int fd = fileno(file);
+        size_t done = 0;
+
+        while (done < record_size) {
+            ssize_t bytes = pread(fd, data + done, record_size - done, (off_t)(index[n].offset + done));
+
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                return false;
+
+            done += bytes;
+        }
+
+        return true;
+#endif
+    }
+};
+
+
+// Curves shared through POSIX shared memory by the processes working on
+// the same source at the same time, so each frame's curves are calculated
+// only once. The shared memory object starts with a ShareHeader, followed
+// by one slot per frame: a state (uint32_t) and record_size bytes of
+// curves, padded to 8 bytes. A process claims an empty slot by switching
+// it to share_writing, combined with its process ID, and publishes it by
+// switching it to share_published once the curves are written. Nobody
+// waits for anybody: a frame whose slot is being written by another
+// process is simply calculated again. A slot left in share_writing by a
+// process that died is taken over by the next process to calculate that
+// frame.
+struct ShareHeader {
+    uint32_t magic; // Set last, when the rest of the header is valid
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t fingerprint;
+    int32_t num_frames;
+    int32_t width;
+    int32_t height;
+    uint32_t source; // Hash of some frames of clip1 and clip2
+};
+
+static const uint32_t share_magic = 0x4d48534d; // "MHSM"
+
+// The state is in the two lowest bits. Above them, share_writing has
+// the ID of the writing process.
+enum ShareState {
+    share_empty = 0,
+    share_writing = 1,
+    share_published = 2
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "std::atomic<uint32_t> can't live in shared memory.");
+
+
+class CurveShare {
+private:
+    uint8_t *memory;
+    size_t memory_size;
+    size_t slot_size;
+    uint32_t record_size;
+    int num_frames;
+    uint32_t writing; // share_writing with this process's ID
+
+    std::atomic<uint32_t> *State(int n) const {
+        return reinterpret_cast<std::atomic<uint32_t> *>(memory + sizeof(ShareHeader) + n * slot_size);
+    }
+
+public:
+    CurveShare()
+        : memory(nullptr)
+        , memory_size(0)
+        , slot_size(0)
+        , record_size(0)
+        , num_frames(0)
+        , writing(share_writing)
+    {
+    }
+
+    ~CurveShare() {
+#ifndef _WIN32
+        if (memory)
+            munmap(memory, memory_size);
+#endif
+    }
+
+    // Creates the shared memory object, or attaches to it if another
+    // process created it first. It stays around until it is removed, for
+    // example from /dev/shm.
+    bool Open(const char *name, uint32_t size, uint32_t fingerprint, uint32_t source, int frames, int width, int height, std::string &error) {
+#ifdef _WIN32
+        (void)name;
+        (void)size;
+        (void)fingerprint;
+        (void)source;
+        (void)frames;
+        (void)width;
+        (void)height;
+
+        error = "curve_share is not supported on Windows.";
+        return false;
+#else
+        std::string path = name[0] == '/' ? name : std::string("/") + name;
+
+        record_size = size;
+        num_frames = frames;
+        writing = share_writing | ((uint32_t)getpid() << 2);
+        slot_size = (sizeof(uint32_t) + record_size + 7) & ~(size_t)7;
+        memory_size = sizeof(ShareHeader) + (size_t)num_frames * slot_size;
+
+        bool created = true;
+
+        // Only the same user may publish curves.
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1 && errno == EEXIST) {
+            created = false;
+            fd = shm_open(path.c_str(), O_RDWR, 0);
+        }
+
+        if (fd == -1) {
+            error = "failed to open shared memory '" + path + "'.";
+            return false;
+        }
+
+        // The new object is filled with zeroes, so every slot starts empty.
+        if (created && ftruncate(fd, (off_t)memory_size)) {
+            error = "failed to resize shared memory '" + path + "'.";
+            close(fd);
+            shm_unlink(path.c_str());
+            return false;
+        }
+
+        // The process that created the object may not have resized it yet.
+        struct stat st;
+
+        for (int tries = 0; !fstat(fd, &st) && st.st_size == 0 && tries < 1000; tries++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        if ((size_t)st.st_size != memory_size) {
+            error = "shared memory '" + path + "' was made with different parameters.";
+            close(fd);
+            return false;
+        }
+
+        void *mapping = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED) {
+            error = "failed to map shared memory '" + path + "'.";
+            return false;
+        }
+
+        memory = (uint8_t *)mapping;
+
+        ShareHeader *header = (ShareHeader *)memory;
+        std::atomic<uint32_t> *magic = reinterpret_cast<std::atomic<uint32_t> *>(&header->magic);
+
+        if (created) {
+            header->version = 3;
+            header->record_size = record_size;
+            header->fingerprint = fingerprint;
+            header->num_frames = num_frames;
+            header->width = width;
+            header->height = height;
+            header->source = source;
+
+            magic->store(share_magic, std::memory_order_release);
+        } else {
+            for (int tries = 0; magic->load(std::memory_order_acquire) != share_magic && tries < 1000; tries++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            if (magic->load(std::memory_order_acquire) != share_magic || header->version != 3) {
+                error = "shared memory '" + path + "' is not a curve share.";
+                return false;
+            }
+
+            if (header->record_size != record_size || header->fingerprint != fingerprint ||
+                header->num_frames != num_frames || header->width != width || header->height != height) {
+                error = "shared memory '" + path + "' was made with different parameters.";
+                return false;
+            }
+
+            if (header->source != source) {
+                error = "shared memory '" + path + "' was made from a different source.";
+                return false;
+            }
+        }
+
+        return true;
+#endif
+    }
+
+    // The process may also be out of sight in another PID namespace. The
+    // slot is then written twice, with the same curves, which is harmless.
+    static bool WriterDied(uint32_t pid) {
+#ifdef _WIN32
+        (void)pid;
+        return false;
+#else
+        return kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+#endif
+    }
+
+    bool Has(int n) const {
+        return n < num_frames && State(n)->load(std::memory_order_acquire) == share_published;
+    }
+
+    // Only valid after Has returned true. Published slots never change.
+    void Read(int n, uint8_t *data) const {
+        memcpy(data, memory + sizeof(ShareHeader) + n * slot_size + sizeof(uint32_t), record_size);
+    }
+
+    void Publish(int n, const uint8_t *data) {
+        if (n >= num_frames)
+            return;
+
+        uint32_t expected = share_empty;
+
+        if (!State(n)->compare_exchange_strong(expected, writing, std::memory_order_acquire)) {
+            // Another process got there first, and is still around.
+            if ((expected & 3) != share_writing || !WriterDied(expected >> 2))
+                return;
+
+            // Its slot is taken over, unless a third process was quicker.
+            if (!State(n)->compare_exchange_strong(expected, writing, std::memory_order_acquire))
+                return;
+        }
+
+        memcpy(memory + sizeof(ShareHeader) + n * slot_size + sizeof(uint32_t), data, record_size);
+
+        State(n)->store(share_published, std::memory_order_release);
+    }
+};
+
+
+// Curves calculated from the last frame, applied to the next one in
+// causal mode. Only used by one thread at a time (fmUnordered), but the
+// frames can still arrive in any order, so when last_frame isn't the
+// frame before the one being made, the state is made again from that
+// frame.
+struct CausalState {
+    int last_frame;
+    CurveData curves[3];
+    uint32_t histogram[256]; // of the last frame's first processed plane, with outlier_threshold
+};
+
+
+// Total variation distance between two histograms: the share of the
+// pixels that would have to change value to turn one into the other,
+// from 0 to 1.
+static double HistogramDistance(const uint32_t *hist1, const uint32_t *hist2) {
+    uint64_t total1 = 0;
+    uint64_t total2 = 0;
+
+    for (int i = 0; i < 256; i++) {
+        total1 += hist1[i];
+        total2 += hist2[i];
+    }
+
+    if (!total1 || !total2)
+        return 1.0;
+
+    double difference = 0.0;
+
+    for (int i = 0; i < 256; i++)
+        difference += std::fabs((double)hist1[i] / total1 - (double)hist2[i] / total2);
+
+    return difference / 2;
+}
+
+
+// Limit on the number of variants in a parameter sweep.
+static const int max_variants = 16;
+
+
+struct MatchHistogramData {
+    VSNodeRef *clip1;
+    VSNodeRef *clip2;
+    VSNodeRef *clip3;
+    VSNodeRef *labels;
+    VSNodeRef *blend_mask;
+    int strength_weight;
+    int blend_weight[256];
+    int num_labels;
+    uint8_t label_map[256];
+    bool raw[3];
+    bool show;
+    bool debug;
+    int debug_size;
+    bool debug_histogram;
+    bool export_curves;
+    bool export_inverse;
+    bool compact_curves;
+    bool autocrop;
+    bool cdf;
+    bool target;
+    uint32_t target_histogram[256];
+    bool opt;
+    int smoothing_window[3];
+    int tolerance[3];
+    double outlier_threshold;
+    int lut_size;
+    LutPool *luts;
+    int process[3];
+    CurveStore *store;
+    CurveShard *shard;
+    CurveShare *share;
+    CausalState *causal;
+    bool variable_size;
+    int num_variants;
+    bool variant_raw[max_variants][3];
+    int variant_smoothing_window[max_variants][3];
+    VSVideoInfo vi;
+};
+
+
+// Size of one frame's curves in a curve shard.
+static uint32_t CurveRecordSize(const MatchHistogramData *d) {
+    if (d->vi.format->colorFamily == cmRGB)
+        return d->lut_size * d->lut_size * d->lut_size * 4 * sizeof(int16_t);
+
+    uint32_t curves = d->vi.format->numPlanes * (d->labels ? d->num_labels : 1);
+
+    return curves * 256 * (d->export_inverse ? 2 : 1);
+}
+
+
+// Identifies the parameters that affect the curves, so that curves made
+// with different parameters are never mixed.
+static uint32_t CurveFingerprint(const MatchHistogramData *d) {
+    const int values[] = {
+        d->vi.format->colorFamily,
+        d->vi.format->bitsPerSample,
+        d->vi.format->subSamplingW,
+        d->vi.format->subSamplingH,
+        d->raw[0],
+        d->raw[1],
+        d->raw[2],
+        d->smoothing_window[0],
+        d->smoothing_window[1],
+        d->smoothing_window[2],
+        d->tolerance[0],
+        d->tolerance[1],
+        d->tolerance[2],
+        d->lut_size,
+        d->labels ? d->num_labels : 0,
+        d->export_inverse,
+        d->autocrop,
+        d->cdf,
+        d->process[0],
+        d->process[1],
+        d->process[2],
+    };
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        for (int b = 0; b < 4; b++) {
+            hash ^= (values[i] >> (b * 8)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+
+    // The target histogram takes the place of clip2.
+    if (d->target) {
+        for (int i = 0; i < 256; i++) {
+            for (int b = 0; b < 4; b++) {
+                hash ^= (d->target_histogram[i] >> (b * 8)) & 0xff;
+                hash *= 16777619u;
+            }
+        }
+    }
+
+    return hash;
+}
+
+
+// Identifies what a curve share was made from, so that its curves are
+// never applied to another source, or to the same source after something
+// upstream changed. The first, middle, and last frames of clip1 and clip2
+// are hashed. Returns false if a frame can't be fetched.
+static bool SourceHash(const MatchHistogramData *d, uint32_t &hash, std::string &error, const VSAPI *vsapi) {
+    VSNodeRef *clips[2] = { d->clip1, d->clip2 };
+    int frames[3] = { 0, d->vi.numFrames / 2, d->vi.numFrames - 1 };
+
+    // FNV-1a
+    hash = 2166136261u;
+
+    for (int c = 0; c < 2 && clips[c]; c++) {
+        for (int i = 0; i < 3; i++) {
+            char message[1024] = { 0 };
+            const VSFrameRef *frame = vsapi->getFrame(frames[i], clips[c], message, sizeof(message));
+
+            if (!frame) {
+                error = std::string("failed to fetch a frame for curve_share: ") + message;
+                return false;
+            }
+
+            for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+                const uint8_t *ptr = vsapi->getReadPtr(frame, plane);
+                int width = vsapi->getFrameWidth(frame, plane);
+                int height = vsapi->getFrameHeight(frame, plane);
+                int stride = vsapi->getStride(frame, plane);
+
+                for (int y = 0; y < height; y++) {
+                    for (int x = 0; x < width; x++) {
+                        hash ^= ptr[x];
+                        hash *= 16777619u;
+                    }
+
+                    ptr += stride;
+                }
+            }
+
+            vsapi->freeFrame(frame);
+        }
+    }
+
+    return true;
+}
+
+
+// Part of the frame, in pixels of the first plane. right and bottom are
+// exclusive. Always made of whole chroma samples.
+struct ActiveArea {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+
+// Pixels at most this bright count as black when looking for borders.
+// This allows for some noise above limited range black.
+static const int border_threshold = 24;
+
+
+static bool IsBorderRow(const VSFrameRef *frame, int y, int left, int right, int num_planes, const VSAPI *vsapi) {
+    for (int plane = 0; plane < num_planes; plane++) {
+        const uint8_t *ptr = vsapi->getReadPtr(frame, plane) + y * vsapi->getStride(frame, plane);
+
+        for (int x = left; x < right; x++)
+            if (ptr[x] > border_threshold)
+                return false;
+    }
+
+    return true;
+}
+
+
+static bool IsBorderColumn(const VSFrameRef *frame, int x, int top, int bottom, int num_planes, const VSAPI *vsapi) {
+    for (int plane = 0; plane < num_planes; plane++) {
+        const uint8_t *ptr = vsapi->getReadPtr(frame, plane) + x;
+        int stride = vsapi->getStride(frame, plane);
+
+        for (int y = top; y < bottom; y++)
+            if (ptr[y * stride] > border_threshold)
+                return false;
+    }
+
+    return true;
+}
+
+
+// Finds the part of the frame inside the black borders of both clips.
+// Only the rows and columns of the borders and the first ones after
+// them are read, and most of those only up to the first bright pixel,
+// so this is cheap enough to do for every frame.
+static ActiveArea FindActiveArea(const VSFrameRef *src1, const VSFrameRef *src2, const MatchHistogramData *d, const VSAPI *vsapi) {
+    int width = vsapi->getFrameWidth(src1, 0);
+    int height = vsapi->getFrameHeight(src1, 0);
+
+    ActiveArea full = { 0, 0, width, height };
+
+    if (!d->autocrop)
+        return full;
+
+    // In RGB clips black must be black in every plane. Otherwise only the
+    // luma is checked.
+    int num_planes = d->vi.format->colorFamily == cmRGB ? 3 : 1;
+
+    ActiveArea area = full;
+
+    const VSFrameRef *frames[2] = { src1, src2 };
+
+    for (int i = 0; i < 2; i++) {
+        while (area.top < area.bottom && IsBorderRow(frames[i], area.top, area.left, area.right, num_planes, vsapi))
+            area.top++;
+        while (area.bottom > area.top && IsBorderRow(frames[i], area.bottom - 1, area.left, area.right, num_planes, vsapi))
+            area.bottom--;
+        while (area.left < area.right && IsBorderColumn(frames[i], area.left, area.top, area.bottom, num_planes, vsapi))
+            area.left++;
+        while (area.right > area.left && IsBorderColumn(frames[i], area.right - 1, area.top, area.bottom, num_planes, vsapi))
+            area.right--;
+    }
+
+    int ssw = d->vi.format->subSamplingW;
+    int ssh = d->vi.format->subSamplingH;
+
+    area.left = ((area.left + (1 << ssw) - 1) >> ssw) << ssw;
+    area.top = ((area.top + (1 << ssh) - 1) >> ssh) << ssh;
+    area.right = (area.right >> ssw) << ssw;
+    area.bottom = (area.bottom >> ssh) << ssh;
+
+    // Most likely a dark scene rather than borders.
+    if ((area.right - area.left) * 2 < width || (area.bottom - area.top) * 2 < height)
+        return full;
+
+    return area;
+}
+
+
+// In cdf mode, hist2 is clip2's histogram of the plane, if it is known
+// without reading clip2's pixels. If counts isn't null, it receives the
+// histogram of the part of clip1 that was read. Not with labels.
+static void AccumulatePlaneCurves(CurveData *curves, CurveData *inverses, const VSFrameRef *src1, const VSFrameRef *src2, const VSFrameRef *labels, const ActiveArea &area, int plane, const uint32_t *hist2, uint32_t *counts, const MatchHistogramData *d, const VSAPI *vsapi) {
+    int ssw = plane ? d->vi.format->subSamplingW : 0;
+    int ssh = plane ? d->vi.format->subSamplingH : 0;
+    int src12_stride = vsapi->getStride(src1, plane);
+    int src12_width = (area.right - area.left) >> ssw;
+    int src12_height = (area.bottom - area.top) >> ssh;
+    int offset = (area.top >> ssh) * src12_stride + (area.left >> ssw);
+    const uint8_t *src1p = vsapi->getReadPtr(src1, plane) + offset;
+    const uint8_t *src2p = src2 ? vsapi->getReadPtr(src2, plane) + offset : nullptr;
+
+    if (d->cdf) {
+        uint32_t hist1[256];
+        uint32_t counted2[256];
+
+        int value = d->opt ? PlaneConstant(src1p, src12_width, src12_height, src12_stride) : -1;
+
+        if (value >= 0) {
+            memset(hist1, 0, sizeof(hist1));
+            hist1[value] = src12_width * src12_height;
+        } else {
+            PlaneHistogram(hist1, src1p, src12_width, src12_height, src12_stride);
+        }
+
+        if (!hist2) {
+            PlaneHistogram(counted2, vsapi->getReadPtr(src2, plane), vsapi->getFrameWidth(src2, plane), vsapi->getFrameHeight(src2, plane), vsapi->getStride(src2, plane));
+            hist2 = counted2;
+        }
+
+        curves->AccumulateCDF(hist1, hist2);
+
+        if (counts)
+            memcpy(counts, hist1, sizeof(hist1));
+
+        if (inverses)
+            inverses->AccumulateCDF(hist2, hist1);
+    } else if (labels) {
+        int label_stride = vsapi->getStride(labels, 0);
+        const uint8_t *labelp = vsapi->getReadPtr(labels, 0) + area.top * label_stride + area.left;
+
+        CurveData::AccumulateLabeled(curves, d->label_map, src1p, src2p, labelp, label_stride, ssw, ssh, src12_width, src12_height, src12_stride, d->num_labels, inverses);
+    } else {
+        curves->Accumulate(src1p, src2p, src12_width, src12_height, src12_stride, inverses, d->tolerance[plane], d->opt);
+
+        if (counts)
+            curves->Counts(counts);
+    }
+}
+
+
+static void FinishPlaneCurves(CurveData *curves, bool raw, int smoothing_window, const MatchHistogramData *d) {
+    if (d->labels)
+        CurveData::FinishLabeled(curves, d->num_labels, raw, smoothing_window);
+    else
+        curves->Finish(raw, smoothing_window);
+}
+
+
+static void CreatePlaneCurves(CurveData *curves, CurveData *inverses, const VSFrameRef *src1, const VSFrameRef *src2, const VSFrameRef *labels, const ActiveArea &area, int plane, const uint32_t *hist2, uint32_t *counts, const MatchHistogramData *d, const VSAPI *vsapi) {
+    AccumulatePlaneCurves(curves, inverses, src1, src2, labels, area, plane, hist2, counts, d, vsapi);
+
+    FinishPlaneCurves(curves, d->raw[plane], d->smoothing_window[plane], d);
+
+    if (inverses)
+        FinishPlaneCurves(inverses, d->raw[plane], d->smoothing_window[plane], d);
+}
+
+
+// Whether the curves of a plane would leave clip3's plane unchanged, so
+// that it can be copied by reference. That is the case when every curve
+// is the identity, or when the plane is a single colour that the curves
+// keep, as in the chroma of greyscale material.
+static bool KeepsPlane(const CurveData *curves, int num_curves, const VSFrameRef *src3, int plane, const MatchHistogramData *d, const VSAPI *vsapi) {
+    if (!d->opt)
+        return false;
+
+    bool identity = true;
+
+    for (int l = 0; l < num_curves && identity; l++)
+        identity = curves[l].IsIdentity(0, 255, d->strength_weight);
+
+    if (identity)
+        return true;
+
+    int value = PlaneConstant(vsapi->getReadPtr(src3, plane), vsapi->getFrameWidth(src3, plane), vsapi->getFrameHeight(src3, plane), vsapi->getStride(src3, plane));
+    if (value < 0)
+        return false;
+
+    for (int l = 0; l < num_curves; l++)
+        if (!curves[l].IsIdentity(value, value, d->strength_weight))
+            return false;
+
+    return true;
+}
+
+
+// Whether two clips have the same dimensions, as far as is known before
+// the frames are requested.
+static bool SameSize(const VSVideoInfo *a, const VSVideoInfo *b) {
+    return a->width == 0 || b->width == 0 || (a->width == b->width && a->height == b->height);
+}
+
+
+static bool SameFrameSize(const VSFrameRef *a, const VSFrameRef *b, const VSAPI *vsapi) {
+    return vsapi->getFrameWidth(a, 0) == vsapi->getFrameWidth(b, 0) &&
+           vsapi->getFrameHeight(a, 0) == vsapi->getFrameHeight(b, 0);
+}
+
+
+// Repeats the checks of MatchHistogramCreate that depend on the
+// dimensions, for clips whose dimensions change from frame to frame.
+// src1 and src2 are null when the curves come from a curve store, and
+// mask is null when there is none. Returns nullptr if all is well.
+static const char *CheckFrameSizes(const VSFrameRef *src1, const VSFrameRef *src2, const VSFrameRef *src3, const VSFrameRef *labels, const VSFrameRef *mask, const MatchHistogramData *d, const VSAPI *vsapi) {
+    if (src1 && !d->cdf && !SameFrameSize(src1, src2, vsapi))
+        return "MatchHistogram: the first two clips must have the same dimensions.";
+
+    if (labels && (!SameFrameSize(labels, src3, vsapi) || (src1 && !SameFrameSize(labels, src1, vsapi))))
+        return "MatchHistogram: labels must have the same dimensions as the other clips.";
+
+    if (mask && !SameFrameSize(mask, src3, vsapi))
+        return "MatchHistogram: blend_mask must have the same dimensions as clip3.";
+
+    if (d->show) {
+        const VSFrameRef *frames[2] = { src3, src1 };
+
+        for (int i = 0; i < 2; i++)
+            if (frames[i] && (vsapi->getFrameWidth(frames[i], 0) < 256 || vsapi->getFrameHeight(frames[i], 0) < 256))
+                return "MatchHistogram: clips must be at least 256x256 pixels when show is True.";
+    }
+
+    return nullptr;
+}
+
+
+// Draws hist as bars width x height pixels, scaled to the largest count.
+static void DebugHistogram(uint8_t *ptr, int stride, int width, int height, const uint32_t *hist) {
+    uint32_t largest = 1;
+    for (int i = 0; i < 256; i++)
+        largest = std::max(largest, hist[i]);
+
+    int top[4096];
+
+    for (int x = 0; x < width; x++)
+        top[x] = height - (int)((uint64_t)hist[x * 256 / width] * height / largest);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            ptr[x] = y >= top[x] ? 192 : 0;
+
+        ptr += stride;
+    }
+}
+
+
+// The debug view when debug_size is given: a panel for each processed
+// plane, side by side, with clip1's histogram under it if
+// debug_histogram is True. The curves are weakened by strength.
+// histograms holds 256 counts per plane, or is null when they aren't
+// known.
+static void DrawDebugView(VSFrameRef *dst, CurveData *curves, int num_curves, const uint32_t *histograms, const MatchHistogramData *d, const VSAPI *vsapi) {
+    for (int plane = 0; plane < d->vi.format->numPlanes; plane++)
+        fillPlane(vsapi->getWritePtr(dst, plane), vsapi->getFrameWidth(dst, plane), vsapi->getFrameHeight(dst, plane), vsapi->getStride(dst, plane), plane ? 128 : 0);
+
+    uint8_t *dstp = vsapi->getWritePtr(dst, 0);
+    int stride = vsapi->getStride(dst, 0);
+    int size = d->debug_size;
+
+    for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+
+        CurveData &curve = curves[plane * num_curves];
+
+        curve.Weaken(d->strength_weight);
+        curve.DebugScaled(dstp, stride, size);
+
+        if (d->debug_histogram && histograms)
+            DebugHistogram(dstp + size * stride, stride, size, size / 4, histograms + plane * 256);
+
+        dstp += size;
+    }
+}
+
+
+static void VS_CC MatchHistogramInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    (void)in;
+    (void)out;
+    (void)core;
+
+    MatchHistogramData *d = (MatchHistogramData *) *instanceData;
+
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+
+static const VSFrameRef *VS_CC MatchHistogramGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    (void)frameData;
+
+    const MatchHistogramData *d = (const MatchHistogramData *) *instanceData;
+
+    // Frames whose curves are in the curve store, or were published by
+    // another process, don't need the first two clips.
+    bool in_store = d->store && d->store->Has(n);
+    bool stored = in_store || (d->share && d->share->Has(n));
+
+    if (activationReason == arInitial) {
+        if (!stored) {
+            vsapi->requestFrameFilter(n, d->clip1, frameCtx);
+            if (d->clip2)
+                vsapi->requestFrameFilter(n, d->clip2, frameCtx);
+        }
+        // In case the causal state has moved on by the time this frame
+        // is made. Usually the previous frames are still in the cache.
+        if (d->causal && n > 0) {
+            vsapi->requestFrameFilter(n - 1, d->clip1, frameCtx);
+            vsapi->requestFrameFilter(n - 1, d->clip2, frameCtx);
+        }
+        vsapi->requestFrameFilter(n, d->clip3, frameCtx);
+        if (d->labels)
+            vsapi->requestFrameFilter(n, d->labels, frameCtx);
+        if (d->blend_mask && !d->debug)
+            vsapi->requestFrameFilter(n, d->blend_mask, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *src1 = stored ? nullptr : vsapi->getFrameFilter(n, d->clip1, frameCtx);
+        const VSFrameRef *src2 = stored || !d->clip2 ? nullptr : vsapi->getFrameFilter(n, d->clip2, frameCtx);
+        const VSFrameRef *labels = d->labels ? vsapi->getFrameFilter(n, d->labels, frameCtx) : nullptr;
+
+        if (d->variable_size) {
+            const VSFrameRef *src3 = vsapi->getFrameFilter(n, d->clip3, frameCtx);
+            const VSFrameRef *mask = d->blend_mask && !d->debug ? vsapi->getFrameFilter(n, d->blend_mask, frameCtx) : nullptr;
+
+            const char *error = CheckFrameSizes(src1, src2, src3, labels, mask, d, vsapi);
+
+            vsapi->freeFrame(src3);
+            vsapi->freeFrame(mask);
+
+            if (error) {
+                vsapi->setFilterError(error, frameCtx);
+                vsapi->freeFrame(src1);
+                vsapi->freeFrame(src2);
+                vsapi->freeFrame(labels);
+                return nullptr;
+            }
+        }
+
+        // The curves are calculated from this part of the first two clips.
+        ActiveArea area = { 0, 0, 0, 0 };
+        if (!stored)
+            area = FindActiveArea(src1, src2, d, vsapi);
+
+        // In cdf mode, clip2's histograms come from the target or from its
+        // frame properties if possible, so that its pixels aren't read.
+        const uint32_t *hist2[3] = { nullptr, nullptr, nullptr };
+        uint32_t hist2_props[3][256];
+
+        if (d->cdf && !stored) {
+            for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+                if (!d->process[plane])
+                    continue;
+
+                if (d->target) {
+                    hist2[plane] = d->target_histogram;
+                    continue;
+                }
+
+                int found = GetHistogramProp(hist2_props[plane], src2, plane, vsapi);
+
+                if (found < 0) {
+                    vsapi->setFilterError("MatchHistogram: clip2 has an invalid MatchHistogramHistogram frame property.", frameCtx);
+                    vsapi->freeFrame(src1);
+                    vsapi->freeFrame(src2);
+                    vsapi->freeFrame(labels);
+                    return nullptr;
+                }
+
+                if (found)
+                    hist2[plane] = hist2_props[plane];
+            }
+        }
+
+        std::vector<uint8_t> record(d->store || d->shard || d->share ? CurveRecordSize(d) : 0);
+
+        if (in_store) {
+            if (!d->store->Read(n, record.data())) {
+                vsapi->setFilterError("MatchHistogram: failed to read the curve store.", frameCtx);
+                vsapi->freeFrame(labels);
+                return nullptr;
+            }
+        } else if (stored) {
+            d->share->Read(n, record.data());
+
+            // The shard gets every frame missing from the store, including
+            // the ones another process published first.
+            if (d->shard && !d->shard->Write(n, record.data()))
+                vsapi->logMessage(mtWarning, "MatchHistogram: failed to write the curve shard.");
+        }
+
+        VSFrameRef *dst;
+
+        if (d->causal) {
+            // clip3 is clip1, so the unprocessed planes come from src1.
+            const VSFrameRef *mask = d->blend_mask ? vsapi->getFrameFilter(n, d->blend_mask, frameCtx) : nullptr;
+
+            const VSFrameRef *plane_src[3] = {
+                d->process[0] ? nullptr : src1,
+                d->process[1] ? nullptr : src1,
+                d->process[2] ? nullptr : src1
+            };
+
+            int planes[3] = { 0, 1, 2 };
+
+            dst = vsapi->newVideoFrame2(d->vi.format, vsapi->getFrameWidth(src1, 0), vsapi->getFrameHeight(src1, 0), plane_src, planes, src1, core);
+
+            // Outliers are found with the histogram of the first processed
+            // plane, which is counted anyway while the curves are made.
+            int check_plane = -1;
+
+            if (d->outlier_threshold > 0.0)
+                for (int plane = d->vi.format->numPlanes - 1; plane >= 0; plane--)
+                    if (d->process[plane])
+                        check_plane = plane;
+
+            // Only the first frame uses its own curves.
+            bool follows = n > 0;
+
+            // After a seek, or when another frame was made in between, the
+            // previous frame's curves are made again, at the cost of reading
+            // it a second time. They are the same as when the frames come in
+            // order, so the output depends only on the frame number.
+            if (follows && d->causal->last_frame != n - 1) {
+                const VSFrameRef *prev1 = vsapi->getFrameFilter(n - 1, d->clip1, frameCtx);
+                const VSFrameRef *prev2 = vsapi->getFrameFilter(n - 1, d->clip2, frameCtx);
+
+                for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+                    if (!d->process[plane])
+                        continue;
+
+                    d->causal->curves[plane].Create(vsapi->getReadPtr(prev1, plane), vsapi->getReadPtr(prev2, plane),
+                                                    vsapi->getFrameWidth(prev1, plane), vsapi->getFrameHeight(prev1, plane), vsapi->getStride(prev1, plane),
+                                                    d->raw[plane], d->smoothing_window[plane], d->opt, nullptr,
+                                                    plane == check_plane ? d->causal->histogram : nullptr);
+                }
+
+                vsapi->freeFrame(prev1);
+                vsapi->freeFrame(prev2);
+            }
+
+            uint8_t show_colors[3] = { 235, 160, 96 };
+
+            for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+                // The other planes were copied by reference from src1, and
+                // asking for a write pointer would copy them again.
+                if (!d->process[plane] && !d->show)
+                    continue;
+
+                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+                int stride = vsapi->getStride(dst, plane);
+
+                CurveData &next = d->causal->curves[plane];
+                CurveData applied;
+
+                if (d->process[plane]) {
+                    const uint8_t *src1p = vsapi->getReadPtr(src1, plane);
+                    const uint8_t *src2p = vsapi->getReadPtr(src2, plane);
+                    const uint8_t *maskp = mask ? vsapi->getReadPtr(mask, plane) : nullptr;
+                    int width = vsapi->getFrameWidth(src1, plane);
+                    int height = vsapi->getFrameHeight(src1, plane);
+
+                    uint32_t hist[256];
+                    uint32_t *counts = plane == check_plane ? hist : nullptr;
+
+                    if (!follows)
+                        next.Create(src1p, src2p, width, height, stride, d->raw[plane], d->smoothing_window[plane], d->opt, nullptr, counts);
+
+                    applied = next;
+
+                    if (d->export_curves)
+                        SetCurveProp(vsapi->getFramePropsRW(dst), "MatchHistogramCurve", plane, &applied, 1, d->compact_curves, vsapi);
+
+                    if (!mask)
+                        applied.Weaken(d->strength_weight);
+
+                    if (follows)
+                        applied.ProcessAndCreate(next, src1p, src2p, dstp, maskp, d->blend_weight, width, height, stride, d->raw[plane], d->smoothing_window[plane], counts);
+                    else
+                        applied.Process(src1p, dstp, maskp, d->blend_weight, width, height, stride);
+
+                    // A flash or a cut: the previous frame's curves don't suit
+                    // this frame, and this frame's curves won't suit the next
+                    // one, so both get their own. This frame's curves are
+                    // already in next, and the remaining planes make theirs
+                    // like after a seek.
+                    if (counts && follows && HistogramDistance(hist, d->causal->histogram) > d->outlier_threshold) {
+                        follows = false;
+
+                        applied = next;
+
+                        if (d->export_curves)
+                            SetCurveProp(vsapi->getFramePropsRW(dst), "MatchHistogramCurve", plane, &applied, 1, d->compact_curves, vsapi);
+
+                        if (!mask)
+                            applied.Weaken(d->strength_weight);
+
+                        applied.Process(src1p, dstp, maskp, d->blend_weight, width, height, stride);
+                    }
+
+                    if (counts)
+                        memcpy(d->causal->histogram, hist, sizeof(hist));
+                }
+
+                if (d->show) {
+                    fillPlane(dstp,
+                              256 >> (plane ? d->vi.format->subSamplingW : 0),
+                              256 >> (plane ? d->vi.format->subSamplingH : 0),
+                              stride,
+                              plane ? 128 : 16);
+
+                    if (d->process[plane]) {
+                        applied.Show(vsapi->getWritePtr(dst, 0),
+                                     vsapi->getStride(dst, 0),
+                                     show_colors[plane]);
+                    }
+                }
+            }
+
+            d->causal->last_frame = n;
+
+            vsapi->freeFrame(mask);
+        } else if (d->num_variants) {
+            const VSFrameRef *src3 = vsapi->getFrameFilter(n, d->clip3, frameCtx);
+            const VSFrameRef *mask = d->blend_mask ? vsapi->getFrameFilter(n, d->blend_mask, frameCtx) : nullptr;
+
+            // The variants are stacked vertically, in the order given.
+            dst = vsapi->newVideoFrame(d->vi.format, vsapi->getFrameWidth(src3, 0), vsapi->getFrameHeight(src3, 0) * d->num_variants, src3, core);
+
+            int num_planes = d->vi.format->numPlanes;
+            int num_curves = d->labels ? d->num_labels : 1;
+
+            // The pixels are counted only once. Each variant finishes its own
+            // copy of the sums.
+            std::vector<CurveData> sums(num_planes * num_curves);
+
+            for (int plane = 0; plane < num_planes; plane++)
+                if (d->process[plane])
+                    AccumulatePlaneCurves(sums.data() + plane * num_curves, nullptr, src1, src2, labels, area, plane, hist2[plane], nullptr, d, vsapi);
+
+            uint8_t show_colors[3] = { 235, 160, 96 };
+
+            for (int v = 0; v < d->num_variants; v++) {
+                for (int plane = 0; plane < num_planes; plane++) {
+                    const uint8_t *src3p = vsapi->getReadPtr(src3, plane);
+                    int src3_width = vsapi->getFrameWidth(src3, plane);
+                    int src3_height = vsapi->getFrameHeight(src3, plane);
+                    int dst_stride = vsapi->getStride(dst, plane);
+                    uint8_t *dstp = vsapi->getWritePtr(dst, plane) + v * src3_height * dst_stride;
+
+                    std::vector<CurveData> plane_curves(sums.begin() + plane * num_curves, sums.begin() + (plane + 1) * num_curves);
+
+                    if (d->process[plane]) {
+                        const uint8_t *maskp = mask ? vsapi->getReadPtr(mask, plane) : nullptr;
+
+                        FinishPlaneCurves(plane_curves.data(), d->variant_raw[v][plane], d->variant_smoothing_window[v][plane], d);
+
+                        if (!mask)
+                            for (int l = 0; l < num_curves; l++)
+                                plane_curves[l].Weaken(d->strength_weight);
+
+                        if (labels) {
+                            const uint8_t *labelp = vsapi->getReadPtr(labels, 0);
+                            int label_stride = vsapi->getStride(labels, 0);
+                            int ssw = plane ? d->vi.format->subSamplingW : 0;
+                            int ssh = plane ? d->vi.format->subSamplingH : 0;
+
+                            CurveData::ProcessLabeled(plane_curves.data(), d->label_map, src3p, dstp, maskp, d->blend_weight, labelp, label_stride, ssw, ssh, src3_width, src3_height, dst_stride);
+                        } else {
+                            plane_curves[0].Process(src3p, dstp, maskp, d->blend_weight, src3_width, src3_height, dst_stride);
+                        }
+                    } else {
+                        vs_bitblt(dstp, dst_stride, src3p, vsapi->getStride(src3, plane), src3_width, src3_height);
+                    }
+
+                    if (d->show) {
+                        fillPlane(dstp,
+                                  256 >> (plane ? d->vi.format->subSamplingW : 0),
+                                  256 >> (plane ? d->vi.format->subSamplingH : 0),
+                                  dst_stride,
+                                  plane ? 128 : 16);
+
+                        if (d->process[plane]) {
+                            int luma_stride = vsapi->getStride(dst, 0);
+                            uint8_t *lumap = vsapi->getWritePtr(dst, 0) + v * vsapi->getFrameHeight(src3, 0) * luma_stride;
+
+                            for (int l = 0; l < num_curves; l++)
+                                plane_curves[l].Show(lumap, luma_stride, show_colors[plane]);
+                        }
+                    }
+                }
+            }
+
+            vsapi->freeFrame(src3);
+            vsapi->freeFrame(mask);
+        } else if (d->vi.format->colorFamily == cmRGB) {
+            const VSFrameRef *src3 = vsapi->getFrameFilter(n, d->clip3, frameCtx);
+            const VSFrameRef *mask = d->blend_mask ? vsapi->getFrameFilter(n, d->blend_mask, frameCtx) : nullptr;
+
+            dst = vsapi->newVideoFrame(d->vi.format, vsapi->getFrameWidth(src3, 0), vsapi->getFrameHeight(src3, 0), src3, core);
+
+            const uint8_t *src3p[3], *maskp[3];
+            uint8_t *dstp[3];
+
+            for (int plane = 0; plane < 3; plane++) {
+                src3p[plane] = vsapi->getReadPtr(src3, plane);
+                maskp[plane] = mask ? vsapi->getReadPtr(mask, plane) : nullptr;
+                dstp[plane] = vsapi->getWritePtr(dst, plane);
+            }
+
+            LutData &lut = *d->luts->Get();
+
+            if (stored) {
+                lut.Load(record.data());
+            } else {
+                const uint8_t *src1p[3], *src2p[3];
+                int src12_stride = vsapi->getStride(src1, 0);
+                int offset = area.top * src12_stride + area.left;
+
+                for (int plane = 0; plane < 3; plane++) {
+                    src1p[plane] = vsapi->getReadPtr(src1, plane) + offset;
+                    src2p[plane] = vsapi->getReadPtr(src2, plane) + offset;
+                }
+
+                lut.Create(src1p, src2p, area.right - area.left, area.bottom - area.top, src12_stride);
+
+                if (d->shard || d->share) {
+                    lut.Save(record.data());
+
+                    if (d->shard && !d->shard->Write(n, record.data()))
+                        vsapi->logMessage(mtWarning, "MatchHistogram: failed to write the curve shard.");
+                    if (d->share)
+                        d->share->Publish(n, record.data());
+                }
+            }
+
+            if (!mask)
+                lut.Weaken(d->strength_weight);
+            lut.Process(src3p, dstp, mask ? maskp : nullptr, d->blend_weight, vsapi->getFrameWidth(src3, 0), vsapi->getFrameHeight(src3, 0), vsapi->getStride(dst, 0), d->opt);
+
+            d->luts->Put(&lut);
+
+            vsapi->freeFrame(src3);
+            vsapi->freeFrame(mask);
+        } else {
+            int num_planes = d->vi.format->numPlanes;
+            int num_curves = d->labels ? d->num_labels : 1;
+
+            // Curves of plane p start at curves[p * num_curves].
+            std::vector<CurveData> curves(num_planes * num_curves);
+            std::vector<CurveData> inverses(d->export_inverse ? num_planes * num_curves : 0);
+
+            // clip1's histogram of each plane for debug_histogram, counted
+            // while the curves are made. Curves from a curve store come
+            // without it.
+            std::vector<uint32_t> histograms(d->debug_size && d->debug_histogram && !stored ? num_planes * 256 : 0);
+
+            if (stored) {
+                for (size_t i = 0; i < curves.size(); i++)
+                    curves[i].Load(record.data() + i * 256);
+                for (size_t i = 0; i < inverses.size(); i++)
+                    inverses[i].Load(record.data() + (curves.size() + i) * 256);
+            } else {
+                for (int plane = 0; plane < num_planes; plane++)
+                    if (d->process[plane])
+                        CreatePlaneCurves(curves.data() + plane * num_curves, d->export_inverse ? inverses.data() + plane * num_curves : nullptr, src1, src2, labels, area, plane, hist2[plane], histograms.empty() ? nullptr : histograms.data() + plane * 256, d, vsapi);
+
+                if (d->shard || d->share) {
+                    for (size_t i = 0; i < curves.size(); i++)
+                        curves[i].Save(record.data() + i * 256);
+                    for (size_t i = 0; i < inverses.size(); i++)
+                        inverses[i].Save(record.data() + (curves.size() + i) * 256);
+
+                    if (d->shard && !d->shard->Write(n, record.data()))
+                        vsapi->logMessage(mtWarning, "MatchHistogram: failed to write the curve shard.");
+                    if (d->share)
+                        d->share->Publish(n, record.data());
+                }
+            }
+
+            const VSFrameRef *src3 = nullptr;
+            const VSFrameRef *mask = nullptr;
+
+            // Planes of clip3 that are copied by reference.
+            bool keep[3] = { false, false, false };
+
+            if (d->debug) {
+                dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src1, core);
+            } else {
+                src3 = vsapi->getFrameFilter(n, d->clip3, frameCtx);
+                mask = d->blend_mask ? vsapi->getFrameFilter(n, d->blend_mask, frameCtx) : nullptr;
+
+                for (int plane = 0; plane < 3; plane++)
+                    keep[plane] = !d->process[plane] || KeepsPlane(curves.data() + plane * num_curves, num_curves, src3, plane, d, vsapi);
+
+                const VSFrameRef *plane_src[3] = {
+                    keep[0] ? src3 : nullptr,
+                    keep[1] ? src3 : nullptr,
+                    keep[2] ? src3 : nullptr
+                };
+
+                int planes[3] = { 0, 1, 2 };
+
+                dst = vsapi->newVideoFrame2(d->vi.format, vsapi->getFrameWidth(src3, 0), vsapi->getFrameHeight(src3, 0), plane_src, planes, src3, core);
+            }
+
+            for (int plane = 0; plane < num_planes; plane++) {
+                if (!d->process[plane])
+                    continue;
+
+                if (d->export_curves)
+                    SetCurveProp(vsapi->getFramePropsRW(dst), "MatchHistogramCurve", plane, curves.data() + plane * num_curves, num_curves, d->compact_curves, vsapi);
+                if (d->export_inverse)
+                    SetCurveProp(vsapi->getFramePropsRW(dst), "MatchHistogramInverseCurve", plane, inverses.data() + plane * num_curves, num_curves, d->compact_curves, vsapi);
+            }
+
+            if (d->debug && d->debug_size) {
+                DrawDebugView(dst, curves.data(), num_curves, histograms.empty() ? nullptr : histograms.data(), d, vsapi);
+            } else if (d->debug) {
+                for (int plane = 0; plane < num_planes; plane++) {
+                    uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+                    int dst_width = vsapi->getFrameWidth(dst, plane);
+                    int dst_height = vsapi->getFrameHeight(dst, plane);
+                    int dst_stride = vsapi->getStride(dst, plane);
+
+                    fillPlane(dstp, dst_width, dst_height, dst_stride, plane ? 128 : 0);
+                }
+
+                for (int plane = 0; plane < num_planes; plane++) {
+                    if (!d->process[plane])
+                        continue;
+
+                    CurveData &curve = curves[plane * num_curves];
+
+                    curve.Weaken(d->strength_weight);
+                    curve.Debug(vsapi->getWritePtr(dst, 0),
+                                vsapi->getStride(dst, 0));
+                }
+            } else { // Not debug
+                uint8_t show_colors[3] = { 235, 160, 96 };
+
+                // Asking for a write pointer would make the core copy a
+                // plane that was copied by reference, so it's only done
+                // for the planes that are written to.
+                for (int plane = 0; plane < num_planes; plane++) {
+                    int src3dst_stride = vsapi->getStride(dst, plane);
+                    CurveData *plane_curves = curves.data() + plane * num_curves;
+
+                    // Also for the planes that are kept, because show draws
+                    // their curves.
+                    if (d->process[plane] && !mask)
+                        for (int l = 0; l < num_curves; l++)
+                            plane_curves[l].Weaken(d->strength_weight);
+
+                    if (!keep[plane]) {
+                        uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+                        const uint8_t *src3p = vsapi->getReadPtr(src3, plane);
+                        int src3dst_width = vsapi->getFrameWidth(src3, plane);
+                        int src3dst_height = vsapi->getFrameHeight(src3, plane);
+                        const uint8_t *maskp = mask ? vsapi->getReadPtr(mask, plane) : nullptr;
+
+                        if (labels) {
+                            const uint8_t *labelp = vsapi->getReadPtr(labels, 0);
+                            int label_stride = vsapi->getStride(labels, 0);
+                            int ssw = plane ? d->vi.format->subSamplingW : 0;
+                            int ssh = plane ? d->vi.format->subSamplingH : 0;
+
+                            CurveData::ProcessLabeled(plane_curves, d->label_map, src3p, dstp, maskp, d->blend_weight, labelp, label_stride, ssw, ssh, src3dst_width, src3dst_height, src3dst_stride);
+                        } else {
+                            plane_curves->Process(src3p, dstp, maskp, d->blend_weight, src3dst_width, src3dst_height, src3dst_stride);
+                        }
+                    }
+
+                    if (d->show) {
+                        fillPlane(vsapi->getWritePtr(dst, plane),
+                                  256 >> (plane ? d->vi.format->subSamplingW : 0),
+                                  256 >> (plane ? d->vi.format->subSamplingH : 0),
+                                  src3dst_stride,
+                                  plane ? 128 : 16);
+
+                        if (d->process[plane]) {
+                            for (int l = 0; l < num_curves; l++)
+                                plane_curves[l].Show(vsapi->getWritePtr(dst, 0),
+                                                     vsapi->getStride(dst, 0),
+                                                     show_colors[plane]);
+                        }
+                    }
+                }
+            }
+
+            vsapi->freeFrame(src3);
+            vsapi->freeFrame(mask);
+        }
+
+        vsapi->freeFrame(src1);
+        vsapi->freeFrame(src2);
+        vsapi->freeFrame(labels);
+
+        return dst;
+    }
+
+    return nullptr;
+}
+
+
+static void VS_CC MatchHistogramFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    (void)core;
+
+    MatchHistogramData *d = (MatchHistogramData *)instanceData;
+
+    vsapi->freeNode(d->clip1);
+    vsapi->freeNode(d->clip2);
+    vsapi->freeNode(d->clip3);
+    vsapi->freeNode(d->labels);
+    vsapi->freeNode(d->blend_mask);
+    delete d->store;
+    delete d->shard;
+    delete d->share;
+    delete d->causal;
+    delete d->luts;
+    free(d);
+}
+
+
+static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    (void)userData;
+
+    MatchHistogramData d;
+    memset(&d, 0, sizeof(d));
+
+    int err;
+
+    d.show = !!vsapi->propGetInt(in, "show", 0, &err);
+    if (err)
+        d.show = false;
+
+    d.debug = !!vsapi->propGetInt(in, "debug", 0, &err);
+    if (err)
+        d.debug = false;
+
+    if (d.debug)
+        d.show = false;
+
+    d.debug_size = int64ToIntS(vsapi->propGetInt(in, "debug_size", 0, &err));
+    if (err)
+        d.debug_size = 0;
+
+    d.debug_histogram = !!vsapi->propGetInt(in, "debug_histogram", 0, &err);
+    if (err)
+        d.debug_histogram = false;
+
+    d.export_curves = !!vsapi->propGetInt(in, "export_curves", 0, &err);
+    if (err)
+        d.export_curves = false;
+
+    d.export_inverse = !!vsapi->propGetInt(in, "export_inverse", 0, &err);
+    if (err)
+        d.export_inverse = false;
+
+    d.compact_curves = !!vsapi->propGetInt(in, "compact_curves", 0, &err);
+    if (err)
+        d.compact_curves = false;
+
+    d.autocrop = !!vsapi->propGetInt(in, "autocrop", 0, &err);
+    if (err)
+        d.autocrop = false;
+
+    d.cdf = !!vsapi->propGetInt(in, "cdf", 0, &err);
+    if (err)
+        d.cdf = false;
+
+    d.opt = !!vsapi->propGetInt(in, "opt", 0, &err);
+    if (err)
+        d.opt = true;
+
+    const char *target = vsapi->propGetData(in, "target", 0, &err);
+    if (err)
+        target = "";
+
+    int num_target_histogram = vsapi->propNumElements(in, "target_histogram");
+
+    double target_mean = vsapi->propGetFloat(in, "target_mean", 0, &err);
+    bool have_target_mean = !err;
+    if (err)
+        target_mean = 127.5;
+
+    double target_sigma = vsapi->propGetFloat(in, "target_sigma", 0, &err);
+    bool have_target_sigma = !err;
+    if (err)
+        target_sigma = 42.5;
+
+    bool causal = !!vsapi->propGetInt(in, "causal", 0, &err);
+    if (err)
+        causal = false;
+
+    d.outlier_threshold = vsapi->propGetFloat(in, "outlier_threshold", 0, &err);
+    if (err)
+        d.outlier_threshold = 0.0;
+
+    // raw, smoothing_window, and tolerance take one value per plane. The
+    // last value given is used for the remaining planes.
+    int num_raw = vsapi->propNumElements(in, "raw");
+    int num_smoothing_window = vsapi->propNumElements(in, "smoothing_window");
+    int num_tolerance = vsapi->propNumElements(in, "tolerance");
+
+    double tolerance[3];
+
+    for (int i = 0; i < 3; i++) {
+        if (num_raw > 0)
+            d.raw[i] = !!vsapi->propGetInt(in, "raw", std::min(i, num_raw - 1), nullptr);
+        else
+            d.raw[i] = false;
+
+        if (num_smoothing_window > 0)
+            d.smoothing_window[i] = int64ToIntS(vsapi->propGetInt(in, "smoothing_window", std::min(i, num_smoothing_window - 1), nullptr));
+        else
+            d.smoothing_window[i] = 8;
+
+        if (num_tolerance > 0)
+            tolerance[i] = vsapi->propGetFloat(in, "tolerance", std::min(i, num_tolerance - 1), nullptr);
+        else
+            tolerance[i] = 0.0;
+    }
+
+    d.lut_size = int64ToIntS(vsapi->propGetInt(in, "lut_size", 0, &err));
+    if (err)
+        d.lut_size = 17;
+
+    d.num_labels = int64ToIntS(vsapi->propGetInt(in, "num_labels", 0, &err));
+    if (err)
+        d.num_labels = 2;
+
+    double strength = vsapi->propGetFloat(in, "strength", 0, &err);
+    if (err)
+        strength = 1.0;
+
+
+    for (int i = 0; i < 3; i++) {
+        if (d.smoothing_window[i] < 0) {
+            vsapi->setError(out, "MatchHistogram: smoothing_window must not be negative.");
+            return;
+        }
+
+        if (tolerance[i] < 0.0 || tolerance[i] > 255.0) {
+            vsapi->setError(out, "MatchHistogram: tolerance must be between 0.0 and 255.0.");
+            return;
+        }
+
+        // In sixteenths of a code value. Any tolerance above 0 enables sampling.
+        d.tolerance[i] = tolerance[i] > 0.0 ? std::max((int)(tolerance[i] * 16 + 0.5), 1) : 0;
+    }
+
+    if (d.outlier_threshold < 0.0 || d.outlier_threshold > 1.0) {
+        vsapi->setError(out, "MatchHistogram: outlier_threshold must be between 0.0 and 1.0.");
+        return;
+    }
+
+    // A multiple of 16, so that the histograms' height is whole in every
+    // subsampling.
+    if (d.debug_size && (d.debug_size < 16 || d.debug_size > 4096 || d.debug_size % 16)) {
+        vsapi->setError(out, "MatchHistogram: debug_size must be 0, or a multiple of 16 from 16 to 4096.");
+        return;
+    }
+
+    if (d.lut_size < 2 || d.lut_size > 65) {
+        vsapi->setError(out, "MatchHistogram: lut_size must be between 2 and 65.");
+        return;
+    }
+
+    if (d.num_labels < 1 || d.num_labels > 256) {
+        vsapi->setError(out, "MatchHistogram: num_labels must be between 1 and 256.");
+        return;
+    }
+
+    if (strength < 0.0 || strength > 1.0) {
+        vsapi->setError(out, "MatchHistogram: strength must be between 0.0 and 1.0.");
+        return;
+    }
+
+    d.strength_weight = (int)(strength * 256 + 0.5);
+
+    // A target distribution replaces clip2 and implies cdf.
+    if (target[0] && num_target_histogram > 0) {
+        vsapi->setError(out, "MatchHistogram: target and target_histogram can't be used together.");
+        return;
+    }
+
+    if ((have_target_mean || have_target_sigma) && strcmp(target, "gaussian")) {
+        vsapi->setError(out, "MatchHistogram: target_mean and target_sigma can only be used with target='gaussian'.");
+        return;
+    }
+
+    if (!(target_mean >= 0.0 && target_mean <= 255.0)) {
+        vsapi->setError(out, "MatchHistogram: target_mean must be between 0 and 255 (inclusive).");
+        return;
+    }
+
+    if (!(target_sigma >= 1.0 && target_sigma <= 1e6)) {
+        vsapi->setError(out, "MatchHistogram: target_sigma must be between 1 and 1000000 (inclusive).");
+        return;
+    }
+
+    if (target[0] || num_target_histogram > 0) {
+        double weights[256];
+
+        if (!strcmp(target, "uniform")) {
+            for (int i = 0; i < 256; i++)
+                weights[i] = 1.0;
+        } else if (!strcmp(target, "gaussian")) {
+            // By default, three standard deviations either side of the middle.
+            for (int i = 0; i < 256; i++)
+                weights[i] = std::exp(-0.5 * ((i - target_mean) / target_sigma) * ((i - target_mean) / target_sigma));
+        } else if (target[0]) {
+            vsapi->setError(out, "MatchHistogram: target must be 'uniform' or 'gaussian'.");
+            return;
+        } else if (num_target_histogram != 256) {
+            vsapi->setError(out, "MatchHistogram: target_histogram must have 256 values.");
+            return;
+        } else {
+            for (int i = 0; i < 256; i++)
+                weights[i] = vsapi->propGetFloat(in, "target_histogram", i, nullptr);
+        }
+
+        double total = 0.0;
+
+        for (int i = 0; i < 256; i++) {
+            if (!(weights[i] >= 0.0) || std::isinf(weights[i])) {
+                vsapi->setError(out, "MatchHistogram: target_histogram values must be finite and not negative.");
+                return;
+            }
+
+            total += weights[i];
+        }
+
+        if (!(total > 0.0)) {
+            vsapi->setError(out, "MatchHistogram: target_histogram must have at least one value above 0.");
+            return;
+        }
+
+        // Scaled to a total of about 2^24, so AccumulateCDF can't overflow.
+        for (int i = 0; i < 256; i++)
+            d.target_histogram[i] = (uint32_t)(weights[i] / total * 16777216.0 + 0.5);
+
+        d.target = true;
+        d.cdf = true;
+    }
+
+    // Parameter sweep. The shorter array is extended by repeating its last
+    // value, and a missing array takes each plane's raw or smoothing_window.
+    int num_sweep_raw = std::max(vsapi->propNumElements(in, "sweep_raw"), 0);
+    int num_sweep_smoothing_window = std::max(vsapi->propNumElements(in, "sweep_smoothing_window"), 0);
+
+    d.num_variants = std::max(num_sweep_raw, num_sweep_smoothing_window);
+
+    if (d.num_variants > max_variants) {
+        vsapi->setError(out, "MatchHistogram: a parameter sweep can have at most 16 variants.");
+        return;
+    }
+
+    for (int v = 0; v < d.num_variants; v++) {
+        for (int i = 0; i < 3; i++) {
+            if (num_sweep_raw)
+                d.variant_raw[v][i] = !!vsapi->propGetInt(in, "sweep_raw", std::min(v, num_sweep_raw - 1), nullptr);
+            else
+                d.variant_raw[v][i] = d.raw[i];
+
+            if (num_sweep_smoothing_window)
+                d.variant_smoothing_window[v][i] = int64ToIntS(vsapi->propGetInt(in, "sweep_smoothing_window", std::min(v, num_sweep_smoothing_window - 1), nullptr));
+            else
+                d.variant_smoothing_window[v][i] = d.smoothing_window[i];
+
+            if (d.variant_smoothing_window[v][i] < 0) {
+                vsapi->setError(out, "MatchHistogram: sweep_smoothing_window must not be negative.");
+                return;
+            }
+        }
+    }
+
+
+    d.clip1 = vsapi->propGetNode(in, "clip1", 0, nullptr);
+    d.vi = *vsapi->getVideoInfo(d.clip1);
+
+    // Without clip2 its checks are made against clip1.
+    d.clip2 = vsapi->propGetNode(in, "clip2", 0, &err);
+    const VSVideoInfo *vi2 = d.clip2 ? vsapi->getVideoInfo(d.clip2) : &d.vi;
+
+    if (!d.clip2 != d.target) {
+        vsapi->setError(out, d.target ? "MatchHistogram: clip2 can't be used with target or target_histogram."
+                                      : "MatchHistogram: clip2 is required unless target or target_histogram is used.");
+        vsapi->freeNode(d.clip1);
+        vsapi->freeNode(d.clip2);
+        return;
+    }
+
+    d.clip3 = vsapi->propGetNode(in, "clip3", 0, &err);
+    bool clip3_is_clip1 = err;
+    if (err)
+        d.clip3 = vsapi->cloneNodeRef(d.clip1);
+    const VSVideoInfo *vi3 = vsapi->getVideoInfo(d.clip3);
+
+    d.labels = vsapi->propGetNode(in, "labels", 0, &err);
+
+    d.blend_mask = vsapi->propGetNode(in, "blend_mask", 0, &err);
+
+    if (d.vi.format != vi2->format ||
+        d.vi.format != vi3->format) {
+        vsapi->setError(out, "MatchHistogram: the clips must have the same format.");
+        vsapi->freeNode(d.clip1);
+        vsapi->freeNode(d.clip2);
+        vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
+        return;
+    }
+
+    // Histograms don't need the pixels of the first two clips to line up.
+    if (!d.cdf && !SameSize(&d.vi, vi2)) {
+        vsapi->setError(out, "MatchHistogram: the first two clips must have the same dimensions.");
         vsapi->freeNode(d.clip1);
         vsapi->freeNode(d.clip2);
         vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
         return;
     }
 
-    if (!d.vi.format || d.vi.width == 0 || d.vi.height == 0 ||
-        vi3->width == 0 || vi3->height == 0) {
-        vsapi->setError(out, "MatchHistogram: the clips must have constant format and dimensions.");
+    // Variable dimensions are checked in GetFrame.
+    if (!d.vi.format) {
+        vsapi->setError(out, "MatchHistogram: the clips must have constant format.");
         vsapi->freeNode(d.clip1);
         vsapi->freeNode(d.clip2);
         vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
         return;
     }
 
-    if (d.vi.format->colorFamily == cmRGB || d.vi.format->bitsPerSample > 8) {
-        vsapi->setError(out, "MatchHistogram: the clips must have 8 bits per sample and must not be RGB.");
+    if (d.vi.format->sampleType != stInteger || d.vi.format->bitsPerSample > 8) {
+        vsapi->setError(out, "MatchHistogram: the clips must have 8 bits per sample.");
         vsapi->freeNode(d.clip1);
         vsapi->freeNode(d.clip2);
         vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
         return;
     }
 
@@ -445,6 +2988,8 @@ static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userDa
             vsapi->freeNode(d.clip1);
             vsapi->freeNode(d.clip2);
             vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
             vsapi->setError(out, "MatchHistogram: plane index out of range");
             return;
         }
@@ -453,6 +2998,8 @@ static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userDa
             vsapi->freeNode(d.clip1);
             vsapi->freeNode(d.clip2);
             vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
             vsapi->setError(out, "MatchHistogram: plane specified twice");
             return;
         }
@@ -460,20 +3007,133 @@ static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userDa
         d.process[o] = 1;
     }
 
-    if (d.show && (d.vi.width < 256 || d.vi.height < 256 || vi3->width < 256 || vi3->height < 256)) {
+    if (d.labels) {
+        const VSVideoInfo *vil = vsapi->getVideoInfo(d.labels);
+
+        if (!vil->format || vil->format->sampleType != stInteger || vil->format->bitsPerSample > 8 ||
+            !SameSize(vil, &d.vi) || !SameSize(vil, vi3) || !SameSize(vi3, &d.vi)) {
+            vsapi->setError(out, "MatchHistogram: labels must have constant format, 8 bits per sample, and the same dimensions as the other clips.");
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            return;
+        }
+
+        if (d.vi.format->colorFamily == cmRGB || d.debug) {
+            vsapi->setError(out, "MatchHistogram: labels are not supported with RGB clips or when debug is True.");
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            return;
+        }
+    }
+
+    if (d.blend_mask) {
+        const VSVideoInfo *vim = vsapi->getVideoInfo(d.blend_mask);
+
+        if (vim->format != vi3->format || !SameSize(vim, vi3)) {
+            vsapi->setError(out, "MatchHistogram: blend_mask must have the same format and dimensions as clip3.");
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            return;
+        }
+    }
+
+    d.variable_size = !d.vi.width || !vi2->width || !vi3->width ||
+                      (d.labels && !vsapi->getVideoInfo(d.labels)->width) ||
+                      (d.blend_mask && !vsapi->getVideoInfo(d.blend_mask)->width);
+
+    // Full strength where the mask is 255.
+    for (int i = 0; i < 256; i++)
+        d.blend_weight[i] = IntDiv(i * d.strength_weight, 255);
+
+    // Label values that don't fit are treated as the last label.
+    for (int i = 0; i < 256; i++)
+        d.label_map[i] = std::min(i, d.num_labels - 1);
+
+    if (d.vi.format->colorFamily == cmRGB) {
+        if (d.show || d.debug) {
+            vsapi->setError(out, "MatchHistogram: show and debug are not supported with RGB clips.");
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            return;
+        }
+
+        // The three planes are always matched together.
+        for (int i = 0; i < 3; i++)
+            d.process[i] = 1;
+    }
+
+    if (d.cdf && (causal || d.labels || d.autocrop || d.vi.format->colorFamily == cmRGB)) {
+        vsapi->setError(out, "MatchHistogram: cdf can't be used with causal, labels, autocrop, or RGB clips.");
+        vsapi->freeNode(d.clip1);
+        vsapi->freeNode(d.clip2);
+        vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
+        return;
+    }
+
+    if (causal && (!clip3_is_clip1 || d.debug || d.labels || d.export_inverse || d.autocrop ||
+                   d.vi.format->colorFamily == cmRGB ||
+                   vsapi->propNumElements(in, "curve_store") > 0 || vsapi->propNumElements(in, "curve_shard") > 0 ||
+                   vsapi->propNumElements(in, "curve_share") > 0)) {
+        vsapi->setError(out, "MatchHistogram: causal can't be used with clip3, debug, labels, export_inverse, autocrop, curve_store, curve_shard, curve_share, or RGB clips.");
+        vsapi->freeNode(d.clip1);
+        vsapi->freeNode(d.clip2);
+        vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
+        return;
+    }
+
+    if (d.num_variants && (causal || d.debug || d.export_curves || d.export_inverse ||
+                           d.vi.format->colorFamily == cmRGB ||
+                           vsapi->propNumElements(in, "curve_store") > 0 || vsapi->propNumElements(in, "curve_shard") > 0 ||
+                           vsapi->propNumElements(in, "curve_share") > 0)) {
+        vsapi->setError(out, "MatchHistogram: sweep_raw and sweep_smoothing_window can't be used with causal, debug, export_curves, export_inverse, curve_store, curve_shard, curve_share, or RGB clips.");
+        vsapi->freeNode(d.clip1);
+        vsapi->freeNode(d.clip2);
+        vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
+        return;
+    }
+
+    if (d.show && ((d.vi.width && (d.vi.width < 256 || d.vi.height < 256)) ||
+                   (vi3->width && (vi3->width < 256 || vi3->height < 256)))) {
         vsapi->setError(out, "MatchHistogram: clips must be at least 256x256 pixels when show is True.");
         vsapi->freeNode(d.clip1);
         vsapi->freeNode(d.clip2);
         vsapi->freeNode(d.clip3);
+        vsapi->freeNode(d.labels);
+        vsapi->freeNode(d.blend_mask);
         return;
     }
 
-    if (d.debug) {
+    if (d.debug && d.debug_size) {
+        int num_panels = std::max(d.process[0] + d.process[1] + d.process[2], 1);
+
+        d.vi.width = d.debug_size * num_panels;
+        d.vi.height = d.debug_size + (d.debug_histogram ? d.debug_size / 4 : 0);
+    } else if (d.debug) {
         if (d.process[0] + d.process[1] + d.process[2] > 1) {
             vsapi->setError(out, "MatchHistogram: only one plane can be processed at a time when debug is True.");
             vsapi->freeNode(d.clip1);
             vsapi->freeNode(d.clip2);
             vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
             return;
         }
 
@@ -481,13 +3141,158 @@ static void VS_CC MatchHistogramCreate(const VSMap *in, VSMap *out, void *userDa
         d.vi.height = 256;
     } else {
         d.vi = *vi3;
+
+        if (d.num_variants)
+            d.vi.height *= d.num_variants;
+    }
+
+
+    const char *store_path = vsapi->propGetData(in, "curve_store", 0, &err);
+    if (!err) {
+        d.store = new CurveStore;
+
+        std::string error;
+
+        if (!d.store->Open(store_path, d.vi.numFrames, error)) {
+            error = "MatchHistogram: " + error;
+        } else if (d.store->RecordSize() != CurveRecordSize(&d) || d.store->Fingerprint() != CurveFingerprint(&d)) {
+            error = "MatchHistogram: curve_store was made with different parameters.";
+        }
+
+        if (!error.empty()) {
+            vsapi->setError(out, error.c_str());
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            delete d.store;
+            return;
+        }
+    }
+
+    const char *shard_path = vsapi->propGetData(in, "curve_shard", 0, &err);
+    if (!err) {
+        d.shard = new CurveShard;
+
+        std::string error;
+
+        if (!d.shard->Open(shard_path, CurveRecordSize(&d), CurveFingerprint(&d), error)) {
+            vsapi->setError(out, ("MatchHistogram: " + error).c_str());
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            delete d.store;
+            delete d.shard;
+            return;
+        }
     }
 
+    const char *share_name = vsapi->propGetData(in, "curve_share", 0, &err);
+    if (!err) {
+        d.share = new CurveShare;
+
+        const VSVideoInfo *vi1 = vsapi->getVideoInfo(d.clip1);
+
+        std::string error;
+        uint32_t source;
+
+        if (!SourceHash(&d, source, error, vsapi) ||
+            !d.share->Open(share_name, CurveRecordSize(&d), CurveFingerprint(&d), source, d.vi.numFrames, vi1->width, vi1->height, error)) {
+            vsapi->setError(out, ("MatchHistogram: " + error).c_str());
+            vsapi->freeNode(d.clip1);
+            vsapi->freeNode(d.clip2);
+            vsapi->freeNode(d.clip3);
+            vsapi->freeNode(d.labels);
+            vsapi->freeNode(d.blend_mask);
+            delete d.store;
+            delete d.shard;
+            delete d.share;
+            return;
+        }
+    }
+
+
+    if (causal) {
+        d.causal = new CausalState;
+        d.causal->last_frame = -2;
+    }
+
+    if (d.vi.format->colorFamily == cmRGB)
+        d.luts = new LutPool(d.lut_size);
+
 
     MatchHistogramData *data = (MatchHistogramData *)malloc(sizeof(d));
     *data = d;
 
-    vsapi->createFilter(in, out, "MatchHistogram", MatchHistogramInit, MatchHistogramGetFrame, MatchHistogramFree, fmParallel, 0, data, core);
+    // Causal mode carries the curves from one frame to the next.
+    vsapi->createFilter(in, out, "MatchHistogram", MatchHistogramInit, MatchHistogramGetFrame, MatchHistogramFree, causal ? fmUnordered : fmParallel, 0, data, core);
+}
+
+
+static void VS_CC MergeCurvesCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    (void)userData;
+    (void)core;
+
+    const char *store_path = vsapi->propGetData(in, "curve_store", 0, nullptr);
+    const char *output = vsapi->propGetData(in, "output", 0, nullptr);
+
+    int err;
+
+    int num_frames = int64ToIntS(vsapi->propGetInt(in, "num_frames", 0, &err));
+    if (err)
+        num_frames = 1 << 24;
+
+    if (num_frames < 1) {
+        vsapi->setError(out, "MergeCurves: num_frames must be at least 1.");
+        return;
+    }
+
+    CurveStore store;
+    std::string error;
+
+    if (!store.Open(store_path, num_frames, error)) {
+        vsapi->setError(out, ("MergeCurves: " + error).c_str());
+        return;
+    }
+
+    // Written next to the output first, so that the output can also be
+    // one of the shards being merged.
+    std::string temp = std::string(output) + ".tmp";
+    remove(temp.c_str());
+
+    {
+        CurveShard shard;
+
+        if (shard.Open(temp.c_str(), store.RecordSize(), store.Fingerprint(), error)) {
+            std::vector<uint8_t> record(store.RecordSize());
+
+            for (int i = 0; i < store.NumFrames(); i++) {
+                if (!store.Has(i))
+                    continue;
+
+                if (!store.Read(i, record.data()) || !shard.Write(i, record.data())) {
+                    error = "failed to copy the curves.";
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!error.empty()) {
+        remove(temp.c_str());
+        vsapi->setError(out, ("MergeCurves: " + error).c_str());
+        return;
+    }
+
+    remove(output);
+
+    if (rename(temp.c_str(), output)) {
+        vsapi->setError(out, (std::string("MergeCurves: failed to create '") + output + "'.").c_str());
+        return;
+    }
 }
 
 
@@ -495,12 +3300,42 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     configFunc("com.nodame.matchhistogram", "matchhist", "MatchHistogram", VAPOURSYNTH_API_VERSION, 1, plugin);
     registerFunc("MatchHistogram",
                  "clip1:clip;"
-                 "clip2:clip;"
+                 "clip2:clip:opt;"
                  "clip3:clip:opt;"
-                 "raw:int:opt;"
+                 "raw:int[]:opt;"
                  "show:int:opt;"
                  "debug:int:opt;"
-                 "smoothing_window:int:opt;"
+                 "debug_size:int:opt;"
+                 "debug_histogram:int:opt;"
+                 "smoothing_window:int[]:opt;"
                  "planes:int[]:opt;"
+                 "lut_size:int:opt;"
+                 "labels:clip:opt;"
+                 "num_labels:int:opt;"
+                 "blend_mask:clip:opt;"
+                 "strength:float:opt;"
+                 "export_curves:int:opt;"
+                 "export_inverse:int:opt;"
+                 "compact_curves:int:opt;"
+                 "causal:int:opt;"
+                 "outlier_threshold:float:opt;"
+                 "curve_store:data:opt;"
+                 "curve_shard:data:opt;"
+                 "curve_share:data:opt;"
+                 "sweep_raw:int[]:opt;"
+                 "sweep_smoothing_window:int[]:opt;"
+                 "tolerance:float[]:opt;"
+                 "autocrop:int:opt;"
+                 "cdf:int:opt;"
+                 "target:data:opt;"
+                 "target_histogram:float[]:opt;"
+                 "target_mean:float:opt;"
+                 "target_sigma:float:opt;"
+                 "opt:int:opt;"
                  , MatchHistogramCreate, nullptr, plugin);
+    registerFunc("MergeCurves",
+                 "curve_store:data;"
+                 "output:data;"
+                 "num_frames:int:opt;"
+                 , MergeCurvesCreate, nullptr, plugin);
 }
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+# Compares MatchHistogram's optimised code (opt=True) with the reference
+# code (opt=False). Both must give bit-identical frames and curve
+# properties, with one thread and with several. The output with several
+# threads must also be the same as with one.
+#
+# Usage: python3 compare_opt.py [path to the plugin]
+#
+# Without a path the plugin must already be autoloaded. Needs Python 3.9
+# or later and VapourSynth R58 or later. Exits with 77, which meson
+# counts as skipped, if VapourSynth can't be imported.
+
+import ctypes
+import hashlib
+import os
+import random
+import sys
+
+try:
+    import vapoursynth as vs
+except ImportError:
+    print('vapoursynth can\'t be imported, skipping')
+    sys.exit(77)
+
+core = vs.core
+
+if len(sys.argv) > 1:
+    core.std.LoadPlugin(sys.argv[1])
+
+FRAMES = 4
+
+
+def fill(width, height, plane, n, kind):
+    # Deterministic content, one byte per pixel, no padding.
+    if kind == 'flat':
+        return bytes([128]) * (width * height)
+    if kind == 'single':
+        return bytes([37 + plane * 50]) * (width * height)
+    if kind == 'ramp':
+        return bytes((x * 3 + y * 2 + n * 5) & 255 for y in range(height) for x in range(width))
+    if kind == 'grey':
+        # Greyscale stored as YUV: constant chroma.
+        if plane:
+            return bytes([128]) * (width * height)
+        return fill(width, height, plane, n, 'noise')
+    if kind == 'grey129':
+        # Greyscale with chroma off by one, so that the curves keep it.
+        if plane:
+            return bytes([129]) * (width * height)
+        return fill(width, height, plane, n, 'ramp')
+    if kind == 'letterbox':
+        # Black bars at the top and bottom, for autocrop.
+        data = bytearray(fill(width, height, plane, n, 'noise'))
+        bar = height // 8
+        black = 128 if plane else 16
+        data[:bar * width] = bytes([black]) * (bar * width)
+        data[(height - bar) * width:] = bytes([black]) * (bar * width)
+        return bytes(data)
+    if kind == 'flash':
+        # Every third frame is much brighter, for outlier_threshold.
+        data = fill(width, height, plane, n, 'noise')
+        if n % 3 == 2 and not plane:
+            return bytes(200 + (v & 31) for v in data)
+        return data
+
+    return random.Random(12345 + n * 77 + plane * 1000).randbytes(width * height)
+
+
+def make_clip(format, width, height, kind, frames=FRAMES):
+    blank = core.std.BlankClip(format=format, width=width, height=height, length=frames)
+
+    def modify(n, f):
+        fout = f.copy()
+        for plane in range(fout.format.num_planes):
+            w = fout.width >> (fout.format.subsampling_w if plane else 0)
+            h = fout.height >> (fout.format.subsampling_h if plane else 0)
+            data = fill(w, h, plane, n, kind)
+            ptr = fout.get_write_ptr(plane).value
+            stride = fout.get_stride(plane)
+            for y in range(h):
+                ctypes.memmove(ptr + y * stride, data[y * w:(y + 1) * w], w)
+        return fout
+
+    return core.std.ModifyFrame(blank, blank, modify)
+
+
+def read_plane(f, plane):
+    w = f.width >> (f.format.subsampling_w if plane else 0)
+    h = f.height >> (f.format.subsampling_h if plane else 0)
+    ptr = f.get_read_ptr(plane).value
+    stride = f.get_stride(plane)
+    return b''.join(ctypes.string_at(ptr + y * stride, w) for y in range(h))
+
+
+def digest(f):
+    # The pixels and the MatchHistogram frame properties.
+    h = hashlib.sha1()
+    for plane in range(f.format.num_planes):
+        h.update(read_plane(f, plane))
+    props = sorted((k, v) for k, v in f.props.items() if k.startswith('MatchHistogram'))
+    h.update(repr(props).encode())
+    return h.hexdigest()
+
+
+def render(clip):
+    # All the frames are requested at once, so that with several threads
+    # they are made in parallel and arrive in any order.
+    futures = [clip.get_frame_async(n) for n in range(clip.num_frames)]
+    return [digest(future.result()) for future in futures]
+
+
+def compare(name, args, threads, single):
+    results = [render(core.matchhist.MatchHistogram(**dict(args, opt=opt))) for opt in (True, False)]
+    mismatches = sum(a != b for a, b in zip(results[0], results[1]))
+
+    # The same as with one thread.
+    if name in single:
+        mismatches += sum(a != b for a, b in zip(results[0], single[name]))
+    else:
+        single[name] = results[0]
+
+    print('{} threads {}: {}'.format(threads, name, 'ok' if not mismatches else '{} mismatches'.format(mismatches)))
+    return mismatches
+
+
+cases = []
+
+for format, sizes in ((vs.YUV420P8, ((2, 2), (18, 10), (320, 256), (1920, 1080))),
+                      (vs.GRAY8, ((1, 1), (17, 9), (320, 256))),
+                      (vs.RGB24, ((1, 1), (17, 9), (320, 256)))):
+    kinds = ['flat', 'single', 'ramp', 'noise', 'letterbox', 'flash'] + (['grey', 'grey129'] if format == vs.YUV420P8 else [])
+
+    for width, height in sizes:
+        big = width >= 256 and height >= 256
+
+        for kind in kinds:
+            clip1 = make_clip(format, width, height, kind)
+            clip2 = make_clip(format, width, height, 'ramp' if kind == 'noise' else 'noise')
+            name = '{} {}x{} {}'.format(clip1.format.name, width, height, kind)
+
+            cases.append((name, dict(clip1=clip1, clip2=clip2, export_curves=True)))
+            cases.append((name + ' identity', dict(clip1=clip1, clip2=clip1, export_curves=True)))
+            cases.append((name + ' autocrop', dict(clip1=clip1, clip2=clip2, autocrop=True, export_curves=True)))
+
+            if format == vs.RGB24:
+                cases.append((name + ' strength', dict(clip1=clip1, clip2=clip2, lut_size=9, strength=0.3)))
+                continue
+
+            planes = list(range(1 if format == vs.GRAY8 else 3))
+            labels = make_clip(vs.GRAY8, width, height, 'noise')
+
+            cases.append((name + ' tolerance', dict(clip1=clip1, clip2=clip2, planes=planes, tolerance=1.0, export_curves=True)))
+            cases.append((name + ' raw inverse', dict(clip1=clip1, clip2=clip2, planes=planes, raw=True, export_curves=True, export_inverse=True)))
+            cases.append((name + ' mask', dict(clip1=clip1, clip2=clip2, planes=planes, blend_mask=clip2, strength=0.5)))
+            cases.append((name + ' labels', dict(clip1=clip1, clip2=clip2, planes=planes, labels=labels, num_labels=3, strength=0.3, export_curves=True)))
+            cases.append((name + ' causal', dict(clip1=clip1, clip2=clip2, planes=planes, causal=True, export_curves=True)))
+            cases.append((name + ' causal outliers', dict(clip1=clip1, clip2=clip2, planes=planes, causal=True, outlier_threshold=0.3, export_curves=True)))
+            cases.append((name + ' cdf', dict(clip1=clip1, clip2=clip2, planes=planes, cdf=True, export_curves=True)))
+            cases.append((name + ' uniform', dict(clip1=clip1, planes=planes, target='uniform', export_curves=True)))
+            cases.append((name + ' gaussian', dict(clip1=clip1, planes=planes, target='gaussian', target_mean=100.0, target_sigma=30.0, export_curves=True)))
+            cases.append((name + ' sweep', dict(clip1=clip1, clip2=clip2, planes=planes, sweep_raw=[False, True], sweep_smoothing_window=[4, 8])))
+            cases.append((name + ' debug_size', dict(clip1=clip1, clip2=clip2, planes=planes, debug=True, debug_size=64, debug_histogram=True, strength=0.3)))
+
+            if big:
+                cases.append((name + ' show strength', dict(clip1=clip1, clip2=clip2, planes=planes, show=True, strength=0.3)))
+                cases.append((name + ' show labels', dict(clip1=clip1, clip2=clip2, planes=planes, labels=labels, num_labels=3, show=True, strength=0.3)))
+                cases.append((name + ' causal show', dict(clip1=clip1, clip2=clip2, planes=planes, causal=True, show=True, strength=0.3)))
+
+failed = 0
+single = {}
+
+for threads in (1, max(os.cpu_count() or 1, 4)):
+    core.num_threads = threads
+    failed += sum(compare(name, args, threads, single) != 0 for name, args in cases)
+
+print('{} cases, {} failed'.format(len(cases) * 2, failed))
+sys.exit(1 if failed else 0)